@@ -0,0 +1,969 @@
+/*
+   Load generator and latency benchmark for the fanout server
+   MIT Licensed
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+
+//log-linear latency histogram in the style of HdrHistogram, values below
+//HISTOGRAM_SUB_COUNT are exact and every power of two above is split into
+//HISTOGRAM_SUB_COUNT / 2 buckets, so each bucket is within 1.6% of its value
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_SIZE ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT / 2 \
+                        + HISTOGRAM_SUB_COUNT / 2)
+
+#define BUFFER_SIZE (256 * 1024)
+//send timestamp carried at the start of every payload, in hex
+#define STAMP_LENGTH 16
+//syscall numbers counted one by one, higher ones are only in the total
+#define SYSCALL_MAX 512
+
+
+struct histogram
+{
+    uint64_t counts[HISTOGRAM_SIZE];
+    uint64_t total;
+    uint64_t max;
+};
+
+
+struct connection
+{
+    int fd;
+    int publisher;
+    //subscribers wait for the reply to the ping sent after subscribing
+    int ready;
+    //next channel a publisher announces on
+    u_int channel;
+    char *input;
+    size_t input_length;
+    char *output;
+    size_t output_start;
+    size_t output_length;
+    //messages a paced publisher has announced
+    unsigned long long sent;
+};
+
+
+struct worker
+{
+    pthread_t thread;
+    u_int id;
+    int epollfd;
+    struct connection *connections;
+    u_int connection_count;
+    u_int subscriber_count;
+    //read by the main thread for progress reports
+    unsigned long long published;
+    unsigned long long delivered;
+    unsigned long long delivered_bytes;
+    struct histogram histogram;
+};
+
+
+//totals from the server's info reply
+struct server_counters
+{
+    unsigned long long event_waits;
+    unsigned long long events;
+};
+
+
+//server threads traced for --syscalls
+struct tracer
+{
+    pthread_t thread;
+    pid_t *tids;
+    u_int tid_count;
+    u_int tid_size;
+    //threads still attached
+    u_int traced;
+    volatile int done;
+    unsigned long long counts[SYSCALL_MAX];
+    unsigned long long total;
+    //what the workers had published and received over the traced window
+    unsigned long long published;
+    unsigned long long delivered;
+};
+
+
+void bench_error (const char *msg);
+uint64_t now_ns (void);
+int is_numeric (char *str);
+int connect_server (void);
+void histogram_record (struct histogram *h, uint64_t value);
+void histogram_merge (struct histogram *to, struct histogram *from);
+uint64_t histogram_value (u_int index);
+uint64_t histogram_percentile (struct histogram *h, double percentile);
+void *worker_run (void *arg);
+void worker_connect (struct worker *w);
+void worker_poll (struct worker *w, int timeout);
+void worker_publish (struct worker *w, uint64_t start);
+void connection_queue (struct connection *c, const char *data,
+                       size_t length);
+void connection_flush (struct worker *w, struct connection *c);
+void connection_read (struct worker *w, struct connection *c);
+void connection_process_line (struct worker *w, struct connection *c,
+                              char *line, size_t length);
+void server_counters (struct server_counters *counters);
+unsigned long long info_value (const char *info, const char *name);
+void *tracer_run (void *arg);
+void tracer_attach (struct tracer *t, pid_t tid, int seize);
+void tracer_stop (struct tracer *t);
+void tracer_totals (unsigned long long *published,
+                    unsigned long long *delivered);
+void tracer_report (struct tracer *t);
+const char *syscall_name (long nr);
+void tracer_wake (int signal);
+
+
+// GLOBAL VARS
+char *host = "127.0.0.1";
+char *port = "1986";
+u_int subscriber_count = 100;
+u_int publisher_count = 1;
+u_int channel_count = 10;
+//channels each subscriber subscribes to
+u_int subscriptions = 1;
+//announcements per second per publisher, 0 = as fast as the server takes
+u_int rate = 1000;
+u_int message_size = 64;
+u_int duration = 10;
+u_int worker_count = 1;
+//server whose syscalls are counted while publishing, 0 = not traced
+pid_t syscall_pid = 0;
+struct tracer tracer;
+
+struct worker *workers;
+pthread_barrier_t ready_barrier;
+//cleared once publishing should stop, then again once draining is done
+volatile int publishing = 1;
+volatile int running = 1;
+//padding shared by every payload
+char *padding;
+
+
+int main (int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"host", 1, 0, 0},
+        {"port", 1, 0, 0},
+        {"subscribers", 1, 0, 0},
+        {"publishers", 1, 0, 0},
+        {"channels", 1, 0, 0},
+        {"subscriptions", 1, 0, 0},
+        {"rate", 1, 0, 0},
+        {"size", 1, 0, 0},
+        {"duration", 1, 0, 0},
+        {"threads", 1, 0, 0},
+        {"help", 0, 0, 0},
+        {"syscalls", 1, 0, 0},
+        {NULL, 0, NULL, 0}
+    };
+
+    int c;
+    int option_index = 0;
+    while ((c = getopt_long (argc, argv, "",
+                              long_options, &option_index)) != -1) {
+        if (c != 0)
+            exit (EXIT_FAILURE);
+
+        //every option but help takes a count
+        if (option_index > 1 && option_index != 10
+             && ( ! is_numeric (optarg))) {
+            printf ("invalid %s: %s\n", long_options[option_index].name,
+                     optarg);
+            exit (EXIT_FAILURE);
+        }
+
+        switch (option_index) {
+            //host
+            case 0:
+                host = optarg;
+                break;
+            //port
+            case 1:
+                port = optarg;
+                break;
+            //subscribers
+            case 2:
+                subscriber_count = atoi (optarg);
+                break;
+            //publishers
+            case 3:
+                publisher_count = atoi (optarg);
+                break;
+            //channels
+            case 4:
+                channel_count = atoi (optarg);
+                break;
+            //subscriptions
+            case 5:
+                subscriptions = atoi (optarg);
+                break;
+            //rate
+            case 6:
+                rate = atoi (optarg);
+                break;
+            //size
+            case 7:
+                message_size = atoi (optarg);
+                break;
+            //duration
+            case 8:
+                duration = atoi (optarg);
+                break;
+            //threads
+            case 9:
+                worker_count = atoi (optarg);
+                break;
+            //help
+            case 10:
+                printf("Usage: fanout-bench [options...]\n");
+                printf("load generator for a running fanout server\n\n");
+                printf("Recognized options are:\n");
+                printf("  --host=HOST              server to connect to, 1\
+27.0.0.1 (default)\n");
+                printf("  --port=PORT              server port, 1986 (defau\
+lt)\n");
+                printf("  --subscribers=N          subscriber connections, \
+100 (default)\n");
+                printf("  --publishers=N           publisher connections, 1\
+ (default)\n");
+                printf("  --channels=N             channels announced on, 1\
+0 (default)\n");
+                printf("  --subscriptions=N        channels per subscriber,\
+ 1 (default)\n");
+                printf("  --rate=N                 announcements per second\
+ per publisher\n");
+                printf("                           1000 (default), 0 = unli\
+mited\n");
+                printf("  --size=BYTES             message size, 64 (defaul\
+t)\n");
+                printf("  --duration=SECONDS       time spent publishing, 1\
+0 (default)\n");
+                printf("  --threads=N              client threads, 1 (defau\
+lt)\n");
+                printf("  --syscalls=PID           count the syscalls of t\
+he server\n");
+                printf("                           while publishing, tracin\
+g slows it\n");
+                printf("                           down so only the counts \
+are meaningful\n");
+                printf("  --help                   show this info and exit\
+\n");
+                exit (EXIT_SUCCESS);
+            //syscalls
+            case 11:
+                syscall_pid = atoi (optarg);
+                break;
+        }
+    }
+
+    if (publisher_count < 1 || channel_count < 1 || worker_count < 1
+         || subscriptions > channel_count || duration < 1) {
+        printf ("invalid options, see --help\n");
+        exit (EXIT_FAILURE);
+    }
+    if (message_size < STAMP_LENGTH)
+        message_size = STAMP_LENGTH;
+
+    if ((padding = malloc (message_size)) == NULL)
+        bench_error ("memory error");
+    memset (padding, 'x', message_size);
+
+    if ((workers = calloc (worker_count, sizeof (struct worker))) == NULL)
+        bench_error ("memory error");
+    pthread_barrier_init (&ready_barrier, NULL, worker_count + 1);
+
+    printf ("%d subscribers, %d publishers, %d channels, %d subscriptions \
+each, %d byte messages, ", subscriber_count, publisher_count, channel_count,
+             subscriptions, message_size);
+    if (rate > 0)
+        printf ("%d msgs/s per publisher\n", rate);
+    else
+        printf ("unlimited rate\n");
+
+    for (u_int i = 0; i < worker_count; i++) {
+        workers[i].id = i;
+        if (pthread_create (&workers[i].thread, NULL, worker_run,
+                             &workers[i]) != 0) {
+            bench_error ("ERROR starting worker thread");
+        }
+    }
+
+    //every subscription is in place before anything is announced
+    pthread_barrier_wait (&ready_barrier);
+
+    struct server_counters before;
+    server_counters (&before);
+    if (syscall_pid > 0) {
+        //interrupts the tracer's waitpid once publishing stops
+        struct sigaction action;
+        memset (&action, 0, sizeof (action));
+        action.sa_handler = tracer_wake;
+        sigaction (SIGUSR1, &action, NULL);
+        if (pthread_create (&tracer.thread, NULL, tracer_run, &tracer) != 0)
+            bench_error ("ERROR starting tracer thread");
+    }
+
+    unsigned long long last_delivered = 0;
+    unsigned long long last_published = 0;
+    for (u_int second = 1; second <= duration; second++) {
+        unsigned long long delivered = 0;
+        unsigned long long published = 0;
+
+        sleep (1);
+        for (u_int i = 0; i < worker_count; i++) {
+            delivered += __atomic_load_n (&workers[i].delivered,
+                                          __ATOMIC_RELAXED);
+            published += __atomic_load_n (&workers[i].published,
+                                          __ATOMIC_RELAXED);
+        }
+        printf ("%3ds: published %llu/s delivered %llu/s\n", second,
+                 published - last_published, delivered - last_delivered);
+        last_delivered = delivered;
+        last_published = published;
+    }
+
+    //let messages in flight arrive
+    publishing = 0;
+    if (syscall_pid > 0) {
+        while ( ! tracer.done) {
+            pthread_kill (tracer.thread, SIGUSR1);
+            usleep (10000);
+        }
+        pthread_join (tracer.thread, NULL);
+    }
+    sleep (1);
+    running = 0;
+
+    struct server_counters after;
+    server_counters (&after);
+
+    struct histogram total;
+    unsigned long long published = 0;
+    unsigned long long delivered = 0;
+    unsigned long long delivered_bytes = 0;
+
+    memset (&total, 0, sizeof (total));
+    for (u_int i = 0; i < worker_count; i++) {
+        pthread_join (workers[i].thread, NULL);
+        published += workers[i].published;
+        delivered += workers[i].delivered;
+        delivered_bytes += workers[i].delivered_bytes;
+        histogram_merge (&total, &workers[i].histogram);
+    }
+
+    printf ("published: %llu (%.0f msgs/s)\n", published,
+             (double) published / duration);
+    printf ("delivered: %llu (%.0f msgs/s, %.1f MB/s)\n", delivered,
+             (double) delivered / duration,
+             (double) delivered_bytes / duration / (1024 * 1024));
+    printf ("latency us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+             histogram_percentile (&total, 50.0) / 1000.0,
+             histogram_percentile (&total, 90.0) / 1000.0,
+             histogram_percentile (&total, 99.0) / 1000.0,
+             histogram_percentile (&total, 99.9) / 1000.0,
+             total.max / 1000.0);
+    //includes the drain after publishing and the info requests themselves
+    unsigned long long waits = after.event_waits - before.event_waits;
+    printf ("server: %llu event waits (%.0f/s), %.1f events per wait\n",
+             waits, (double) waits / duration, waits
+             ? (double) (after.events - before.events) / waits : 0.0);
+    if (syscall_pid > 0)
+        tracer_report (&tracer);
+    return 0;
+}
+
+
+void bench_error (const char *msg)
+{
+    fprintf (stderr, "%s: %s\n", msg, strerror (errno));
+    exit (1);
+}
+
+
+uint64_t now_ns ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+int is_numeric (char *str)
+{
+    while (*str) {
+        if (!isdigit (*str))
+            return 0;
+        str++;
+    }
+    return 1;
+}
+
+
+int connect_server ()
+{
+    struct addrinfo hints, *ai, *runp;
+    int fd = -1;
+    int optval = 1;
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo (host, port, &hints, &ai) != 0)
+        bench_error ("getaddrinfo");
+
+    for (runp = ai; runp != NULL; runp = runp->ai_next) {
+        if ((fd = socket (runp->ai_family, runp->ai_socktype,
+                          runp->ai_protocol)) == -1)
+            continue;
+        if (connect (fd, runp->ai_addr, runp->ai_addrlen) == 0)
+            break;
+        close (fd);
+        fd = -1;
+    }
+    freeaddrinfo (ai);
+
+    if (fd == -1)
+        bench_error ("ERROR connecting to server");
+    setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof (optval));
+    return fd;
+}
+
+
+void histogram_record (struct histogram *h, uint64_t value)
+{
+    u_int index = value;
+
+    if (value >= HISTOGRAM_SUB_COUNT) {
+        //top HISTOGRAM_SUB_BITS bits of the value pick the bucket
+        u_int shift = 63 - __builtin_clzll (value) - (HISTOGRAM_SUB_BITS - 1);
+        index = shift * (HISTOGRAM_SUB_COUNT / 2) + (value >> shift);
+    }
+    h->counts[index]++;
+    h->total++;
+    if (value > h->max)
+        h->max = value;
+}
+
+
+void histogram_merge (struct histogram *to, struct histogram *from)
+{
+    for (u_int i = 0; i < HISTOGRAM_SIZE; i++) {
+        to->counts[i] += from->counts[i];
+    }
+    to->total += from->total;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+
+//highest value that falls in a bucket
+uint64_t histogram_value (u_int index)
+{
+    if (index < HISTOGRAM_SUB_COUNT)
+        return index;
+
+    u_int shift = index / (HISTOGRAM_SUB_COUNT / 2) - 1;
+    uint64_t sub = index - shift * (HISTOGRAM_SUB_COUNT / 2);
+    return ((sub + 1) << shift) - 1;
+}
+
+
+uint64_t histogram_percentile (struct histogram *h, double percentile)
+{
+    uint64_t wanted = h->total * percentile / 100.0;
+    uint64_t seen = 0;
+
+    if (h->total == 0)
+        return 0;
+    for (u_int i = 0; i < HISTOGRAM_SIZE; i++) {
+        seen += h->counts[i];
+        if (seen > wanted)
+            return histogram_value (i) < h->max ? histogram_value (i)
+                                                : h->max;
+    }
+    return h->max;
+}
+
+
+void *worker_run (void *arg)
+{
+    struct worker *w = arg;
+
+    if ((w->epollfd = epoll_create1 (0)) == -1)
+        bench_error ("epoll_create");
+    worker_connect (w);
+
+    //wait for the ping replies that follow the subscriptions
+    u_int ready = 0;
+    while (ready < w->subscriber_count) {
+        worker_poll (w, 100);
+        ready = 0;
+        for (u_int i = 0; i < w->connection_count; i++) {
+            connection_flush (w, &w->connections[i]);
+            ready += w->connections[i].ready;
+        }
+    }
+    pthread_barrier_wait (&ready_barrier);
+
+    uint64_t start = now_ns ();
+    while (running) {
+        if (publishing)
+            worker_publish (w, start);
+        worker_poll (w, rate > 0 ? 1 : 0);
+    }
+    return NULL;
+}
+
+
+//subscribers and publishers are dealt out to the workers round robin
+void worker_connect (struct worker *w)
+{
+    struct epoll_event ev;
+    char line[64];
+    u_int total = subscriber_count + publisher_count;
+
+    if ((w->connections = calloc (total / worker_count + 1,
+                                  sizeof (struct connection))) == NULL)
+        bench_error ("memory error");
+
+    for (u_int i = w->id; i < total; i += worker_count) {
+        struct connection *c = &w->connections[w->connection_count++];
+
+        c->fd = connect_server ();
+        c->publisher = i >= subscriber_count;
+        c->ready = c->publisher;
+        c->channel = i;
+        if ((c->input = malloc (BUFFER_SIZE)) == NULL
+             || (c->output = malloc (BUFFER_SIZE)) == NULL)
+            bench_error ("memory error");
+
+        if ( ! c->publisher) {
+            w->subscriber_count++;
+            for (u_int j = 0; j < subscriptions; j++) {
+                int length = snprintf (line, sizeof (line),
+                                       "subscribe bench.%u\n",
+                                       (i * subscriptions + j)
+                                       % channel_count);
+                connection_queue (c, line, length);
+            }
+            connection_queue (c, "ping\n", 5);
+            connection_flush (w, c);
+        }
+
+        //output is retried from the worker loop rather than on EPOLLOUT
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl (w->epollfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+            bench_error ("epoll_ctl");
+    }
+}
+
+
+void worker_poll (struct worker *w, int timeout)
+{
+    struct epoll_event events[64];
+    int nevents;
+
+    if ((nevents = epoll_wait (w->epollfd, events, 64, timeout)) == -1) {
+        if (errno == EINTR)
+            return;
+        bench_error ("epoll_wait");
+    }
+
+    for (int n = 0; n < nevents; n++) {
+        struct connection *c = events[n].data.ptr;
+
+        connection_read (w, c);
+    }
+}
+
+
+//paced publishers catch up to where the rate says they should be, the
+//others keep their output buffer full
+void worker_publish (struct worker *w, uint64_t start)
+{
+    char line[64];
+    uint64_t elapsed = now_ns () - start;
+
+    for (u_int i = 0; i < w->connection_count; i++) {
+        struct connection *c = &w->connections[i];
+        unsigned long long due;
+
+        if ( ! c->publisher)
+            continue;
+
+        due = rate > 0 ? elapsed * rate / 1000000000 - c->sent : ULLONG_MAX;
+        while (due-- > 0 && c->output_length + message_size + sizeof (line)
+                             < BUFFER_SIZE) {
+            int length = snprintf (line, sizeof (line),
+                                   "announce bench.%u %016llx",
+                                   c->channel++ % channel_count,
+                                   (unsigned long long) now_ns ());
+            connection_queue (c, line, length);
+            connection_queue (c, padding, message_size - STAMP_LENGTH);
+            connection_queue (c, "\n", 1);
+            c->sent++;
+            __atomic_add_fetch (&w->published, 1, __ATOMIC_RELAXED);
+        }
+        connection_flush (w, c);
+    }
+}
+
+
+void connection_queue (struct connection *c, const char *data,
+                       size_t length)
+{
+    if (c->output_start > 0 && c->output_start + c->output_length + length
+                                > BUFFER_SIZE) {
+        memmove (c->output, c->output + c->output_start, c->output_length);
+        c->output_start = 0;
+    }
+    if (c->output_start + c->output_length + length > BUFFER_SIZE) {
+        fprintf (stderr, "output buffer full\n");
+        exit (1);
+    }
+    memcpy (c->output + c->output_start + c->output_length, data, length);
+    c->output_length += length;
+}
+
+
+void connection_flush (struct worker *w, struct connection *c)
+{
+    while (c->output_length > 0) {
+        ssize_t sent = send (c->fd, c->output + c->output_start,
+                             c->output_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            bench_error ("ERROR sending to server");
+        }
+        c->output_start += sent;
+        c->output_length -= sent;
+    }
+    c->output_start = 0;
+}
+
+
+void connection_read (struct worker *w, struct connection *c)
+{
+    while (1) {
+        ssize_t received = recv (c->fd, c->input + c->input_length,
+                                 BUFFER_SIZE - c->input_length,
+                                 MSG_DONTWAIT);
+        if (received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            bench_error ("ERROR reading from server");
+        }
+        if (received == 0) {
+            fprintf (stderr, "server closed the connection\n");
+            exit (1);
+        }
+        c->input_length += received;
+
+        char *line = c->input;
+        char *end = c->input + c->input_length;
+        char *newline;
+        while ((newline = memchr (line, '\n', end - line)) != NULL) {
+            connection_process_line (w, c, line, newline - line);
+            line = newline + 1;
+        }
+        c->input_length = end - line;
+        memmove (c->input, line, c->input_length);
+
+        if (c->input_length == BUFFER_SIZE) {
+            fprintf (stderr, "line longer than %d bytes\n", BUFFER_SIZE);
+            exit (1);
+        }
+    }
+}
+
+
+void connection_process_line (struct worker *w, struct connection *c,
+                              char *line, size_t length)
+{
+    char *message;
+
+    //the reply to the ping sent after subscribing
+    if ( ! c->ready && length > 0 && isdigit (line[0])) {
+        c->ready = 1;
+        return;
+    }
+    if (c->publisher || length < 7 || memcmp (line, "bench.", 6)
+         || (message = memchr (line, '!', length)) == NULL
+         || line + length - message - 1 < STAMP_LENGTH)
+        return;
+
+    uint64_t stamp = 0;
+    for (int i = 1; i <= STAMP_LENGTH; i++) {
+        char digit = message[i];
+        stamp = (stamp << 4) | (isdigit (digit) ? digit - '0'
+                                                : digit - 'a' + 10);
+    }
+    histogram_record (&w->histogram, now_ns () - stamp);
+    __atomic_add_fetch (&w->delivered, 1, __ATOMIC_RELAXED);
+    w->delivered_bytes += length + 1;
+}
+
+
+//event loop totals from an info request on a connection of its own
+void server_counters (struct server_counters *counters)
+{
+    char buffer[8192];
+    size_t length = 0;
+    int fd = connect_server ();
+
+    if (send (fd, "info\nping\n", 10, MSG_NOSIGNAL) != 10)
+        bench_error ("ERROR sending to server");
+
+    //the ping reply is the first line starting with a digit
+    while (1) {
+        char *line = buffer;
+        ssize_t received = recv (fd, buffer + length,
+                                 sizeof (buffer) - length - 1, 0);
+        if (received <= 0)
+            bench_error ("ERROR reading info from server");
+        length += received;
+        buffer[length] = '\0';
+        while (line != NULL && ! isdigit (*line)) {
+            line = strchr (line, '\n');
+            if (line != NULL)
+                line++;
+        }
+        if (line != NULL && strchr (line, '\n') != NULL)
+            break;
+        if (length == sizeof (buffer) - 1) {
+            fprintf (stderr, "info reply longer than %d bytes\n",
+                     (int) sizeof (buffer));
+            exit (1);
+        }
+    }
+    close (fd);
+
+    counters->event_waits = info_value (buffer, "total event waits");
+    counters->events = info_value (buffer, "total events");
+}
+
+
+unsigned long long info_value (const char *info, const char *name)
+{
+    const char *line = info;
+    size_t length = strlen (name);
+
+    while (line != NULL) {
+        if ( ! strncmp (line, name, length) && line[length] == ':')
+            return strtoull (line + length + 1, NULL, 10);
+        if ((line = strchr (line, '\n')) != NULL)
+            line++;
+    }
+    return 0;
+}
+
+
+//counts the syscalls every server thread enters until publishing stops,
+//each one stops the thread for the tracer so the server runs far slower
+void *tracer_run (void *arg)
+{
+    struct tracer *t = arg;
+    struct __ptrace_syscall_info info;
+    struct dirent *entry;
+    char path[64];
+    DIR *dir;
+    int status;
+    int stopping = 0;
+    pid_t tid;
+
+    snprintf (path, sizeof (path), "/proc/%d/task", (int) syscall_pid);
+    if ((dir = opendir (path)) == NULL)
+        bench_error ("ERROR listing server threads");
+    while ((entry = readdir (dir)) != NULL) {
+        if ((tid = atoi (entry->d_name)) > 0)
+            tracer_attach (t, tid, 1);
+    }
+    closedir (dir);
+    if (t->traced == 0)
+        bench_error ("ERROR tracing server");
+    tracer_totals (&t->published, &t->delivered);
+
+    while (t->traced > 0) {
+        if ( ! stopping && ! publishing) {
+            //threads waiting for events are stopped to be detached
+            stopping = 1;
+            tracer_stop (t);
+        }
+
+        if ((tid = waitpid (-1, &status, __WALL)) == -1) {
+            if (errno == EINTR)
+                continue;
+            bench_error ("ERROR waiting for server threads");
+        }
+        if (WIFEXITED (status) || WIFSIGNALED (status)) {
+            t->traced--;
+            continue;
+        }
+        if ( ! WIFSTOPPED (status))
+            continue;
+
+        if (stopping) {
+            ptrace (PTRACE_DETACH, tid, 0, 0);
+            t->traced--;
+            continue;
+        }
+
+        int signal = WSTOPSIG (status);
+        if (signal == (SIGTRAP | 0x80)) {
+            if (ptrace (PTRACE_GET_SYSCALL_INFO, tid, sizeof (info), &info) > 0
+                 && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                if (info.entry.nr < SYSCALL_MAX)
+                    t->counts[info.entry.nr]++;
+                t->total++;
+            }
+            signal = 0;
+        } else if (status >> 16 == PTRACE_EVENT_CLONE) {
+            //new threads are attached by the kernel and start stopped
+            unsigned long child;
+            ptrace (PTRACE_GETEVENTMSG, tid, 0, &child);
+            tracer_attach (t, child, 0);
+            signal = 0;
+        } else if (status >> 16 == PTRACE_EVENT_STOP || signal == SIGTRAP) {
+            signal = 0;
+        }
+        ptrace (PTRACE_SYSCALL, tid, 0, signal);
+    }
+
+    unsigned long long published, delivered;
+    tracer_totals (&published, &delivered);
+    t->published = published - t->published;
+    t->delivered = delivered - t->delivered;
+    t->done = 1;
+    return NULL;
+}
+
+
+//threads from clone events are attached by the kernel already
+void tracer_attach (struct tracer *t, pid_t tid, int seize)
+{
+    //io_uring workers refuse to be traced, their work is no syscall
+    if (seize && ptrace (PTRACE_SEIZE, tid, 0, PTRACE_O_TRACESYSGOOD
+                         | PTRACE_O_TRACECLONE) == -1)
+        return;
+    if (seize)
+        ptrace (PTRACE_INTERRUPT, tid, 0, 0);
+
+    if (t->tid_count == t->tid_size) {
+        t->tid_size = t->tid_size ? t->tid_size * 2 : 16;
+        if ((t->tids = realloc (t->tids, t->tid_size * sizeof (pid_t)))
+             == NULL)
+            bench_error ("memory error");
+    }
+    t->tids[t->tid_count++] = tid;
+    t->traced++;
+}
+
+
+void tracer_stop (struct tracer *t)
+{
+    for (u_int i = 0; i < t->tid_count; i++) {
+        ptrace (PTRACE_INTERRUPT, t->tids[i], 0, 0);
+    }
+}
+
+
+void tracer_totals (unsigned long long *published,
+                    unsigned long long *delivered)
+{
+    *published = 0;
+    *delivered = 0;
+    for (u_int i = 0; i < worker_count; i++) {
+        *published += __atomic_load_n (&workers[i].published,
+                                       __ATOMIC_RELAXED);
+        *delivered += __atomic_load_n (&workers[i].delivered,
+                                       __ATOMIC_RELAXED);
+    }
+}
+
+
+void tracer_report (struct tracer *t)
+{
+    printf ("server syscalls: %llu, %.2f per announcement, %.3f per \
+delivery\n", t->total,
+             t->published ? (double) t->total / t->published : 0.0,
+             t->delivered ? (double) t->total / t->delivered : 0.0);
+
+    //the five most frequent
+    printf ("busiest syscalls:");
+    for (int n = 0; n < 5; n++) {
+        int busiest = -1;
+        for (int i = 0; i < SYSCALL_MAX; i++) {
+            if (t->counts[i] > 0 && (busiest == -1
+                 || t->counts[i] > t->counts[busiest]))
+                busiest = i;
+        }
+        if (busiest == -1)
+            break;
+        printf (" %s %.1f%%", syscall_name (busiest),
+                 100.0 * t->counts[busiest] / t->total);
+        t->counts[busiest] = 0;
+    }
+    printf ("\n");
+}
+
+
+const char *syscall_name (long nr)
+{
+    static char number[16];
+
+    switch (nr) {
+#ifdef SYS_epoll_wait
+        case SYS_epoll_wait: return "epoll_wait";
+#endif
+        case SYS_epoll_pwait: return "epoll_pwait";
+        case SYS_epoll_ctl: return "epoll_ctl";
+        case SYS_read: return "read";
+        case SYS_write: return "write";
+        case SYS_recvfrom: return "recvfrom";
+        case SYS_sendto: return "sendto";
+        case SYS_sendmsg: return "sendmsg";
+        case SYS_accept4: return "accept4";
+        case SYS_close: return "close";
+        case SYS_futex: return "futex";
+        case SYS_msync: return "msync";
+        case SYS_io_uring_enter: return "io_uring_enter";
+    }
+    snprintf (number, sizeof (number), "syscall %ld", nr);
+    return number;
+}
+
+
+//only there to interrupt waitpid in the tracer
+void tracer_wake (int signal)
+{
+}
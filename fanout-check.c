@@ -0,0 +1,122 @@
+/*
+   Correctness checks of the fanout internals, run by "make check"
+   MIT Licensed
+*/
+
+//the server is built into this binary with its main renamed, as in
+//fanout-micro
+#define main fanout_main
+#include "fanout.c"
+#undef main
+
+
+void check_setup (void);
+struct client *check_client (int fd);
+int check_journal_order (void);
+
+
+int main (int argc, char *argv[])
+{
+    int failed = 0;
+
+    check_setup ();
+    failed += check_journal_order ();
+
+    printf ("%s\n", failed ? "FAIL" : "ok");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+//stand in for the first event loop inside a pass, output is queued until
+//it is flushed or outgrows max_output_buffer
+void check_setup ()
+{
+    //failing syscalls are reported by the checks themselves
+    debug_level = -1;
+    server_start_time = (long) time (NULL);
+
+    if ((shards = calloc (1, sizeof (struct shard))) == NULL)
+        fanout_error ("memory error");
+    current_shard = shards;
+    shards->stats = &stats;
+    shards->pools = pools;
+    if ((epollfd = epoll_create1 (0)) == -1)
+        fanout_error ("epoll_create");
+    batching = 1;
+}
+
+
+//a client writing to fd, subscribed to "all" like a new connection
+struct client *check_client (int fd)
+{
+    struct client *c;
+
+    if ((c = pool_alloc (&pools[POOL_CLIENT])) == NULL)
+        fanout_error ("memory error");
+    c->type = FD_TYPE_CLIENT;
+    c->fd = fd;
+    c->next = client_head;
+    if (client_head != NULL)
+        client_head->previous = c;
+    client_head = c;
+    __atomic_add_fetch (&current_client_count, 1, __ATOMIC_RELAXED);
+    subscribe (c, "all", 3);
+    return c;
+}
+
+
+//a subscriber's capped output is written out in the middle of the batch,
+//no message may reach its socket before the journal record numbering it
+//is synced; returns 1 on failure
+int check_journal_order ()
+{
+    char dir[] = "/tmp/fanout-check.XXXXXX";
+    char payload[32];
+    char buffer[65536];
+    unsigned long long received = 0;
+    int failed = 0;
+    int sockets[2];
+    struct dirent *entry;
+    DIR *d;
+
+    if (mkdtemp (dir) == NULL)
+        fanout_error ("mkdtemp");
+    if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sockets) == -1)
+        fanout_error ("socketpair");
+    journal.dir = dir;
+    history_messages = 16;
+    max_output_buffer = 4096;
+    journal_open ();
+
+    subscribe (check_client (sockets[0]), "durable", 7);
+
+    for (u_int i = 0; i < 10000 && ! failed; i++) {
+        sprintf (payload, "%u", i);
+        announce ("durable", 7, payload, strlen (payload));
+
+        //every message is a line, the nth one received is record n
+        ssize_t length;
+        while ((length = read (sockets[1], buffer, sizeof (buffer))) > 0) {
+            for (ssize_t j = 0; j < length; j++)
+                received += buffer[j] == '\n';
+        }
+        if (received > ((struct journal_header *) journal.map)->record_count)
+            failed = 1;
+    }
+    printf ("journal synced before sending: %s (%llu messages received)\n",
+             failed ? "FAIL" : "ok", received);
+
+    while (client_head != NULL)
+        shutdown_client (client_head);
+    close (sockets[1]);
+    journal_seal ();
+    if ((d = opendir (dir)) == NULL)
+        fanout_error ("opendir");
+    while ((entry = readdir (d)) != NULL) {
+        if (entry->d_name[0] != '.')
+            unlinkat (dirfd (d), entry->d_name, 0);
+    }
+    closedir (d);
+    rmdir (dir);
+    return failed;
+}
@@ -0,0 +1,558 @@
+/*
+   In-process microbenchmarks for the fanout data structures
+   MIT Licensed
+*/
+
+//the server is built into this binary with its main renamed, so every
+//function and per shard variable is reachable directly
+#define main fanout_main
+#include "fanout.c"
+#undef main
+
+
+//scales each benchmark runs at, capped by --max-scale
+#define SCALE_COUNT 4
+//work per timed run, so small scales are repeated long enough to measure
+#define MIN_OPS 100000
+
+
+void micro_setup (void);
+uint64_t micro_now (void);
+void micro_report (const char *name, u_int scale, unsigned long long ops,
+                   uint64_t elapsed, unsigned long long allocated);
+struct client *micro_client (void);
+void micro_shutdown_all (void);
+void micro_sink (void);
+char *micro_name (char *buffer, const char *prefix, u_int i);
+void bench_subscribe_channels (u_int scale);
+void bench_subscribe_one_channel (u_int scale);
+void bench_announce_channels (u_int scale);
+void bench_announce_fanout (u_int scale);
+void bench_announce_patterns (u_int scale);
+void bench_announce_wildcards (u_int scale);
+void bench_shutdown_client (u_int scale);
+void bench_process_input (u_int scale);
+void bench_announce_durable (u_int scale);
+
+
+// GLOBAL VARS
+u_int scales[SCALE_COUNT] = { 10, 1000, 100000, 1000000 };
+u_int max_scale = 1000000;
+//calls into the allocator, counted by the wrappers below
+unsigned long long allocations = 0;
+
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+
+//interpose the allocator so library calls like asprintf are counted too
+void *malloc (size_t size)
+{
+    allocations++;
+    return __libc_malloc (size);
+}
+
+
+void *calloc (size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc (count, size);
+}
+
+
+void *realloc (void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc (ptr, size);
+}
+
+
+void free (void *ptr)
+{
+    __libc_free (ptr);
+}
+
+
+int main (int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"max-scale", 1, 0, 0},
+        {"help", 0, 0, 0},
+        {NULL, 0, NULL, 0}
+    };
+
+    int c;
+    int option_index = 0;
+    while ((c = getopt_long (argc, argv, "",
+                              long_options, &option_index)) != -1) {
+        if (c != 0)
+            exit (EXIT_FAILURE);
+
+        switch (option_index) {
+            //max-scale
+            case 0:
+                if ( ! is_numeric (optarg) || atoi (optarg) < 1) {
+                    printf ("invalid max scale: %s\n", optarg);
+                    exit (EXIT_FAILURE);
+                }
+                max_scale = atoi (optarg);
+                break;
+            //help
+            case 1:
+                printf("Usage: fanout-micro [options...]\n");
+                printf("microbenchmarks of the fanout data structures\n\n");
+                printf("Recognized options are:\n");
+                printf("  --max-scale=N            largest number of client\
+s, channels\n");
+                printf("                           or subscriptions, 100000\
+0 (default)\n");
+                printf("  --help                   show this info and exit\
+\n");
+                exit (EXIT_SUCCESS);
+        }
+    }
+
+    micro_setup ();
+
+    printf ("%-36s %8s %10s %10s\n", "operation", "scale", "ns/op",
+             "allocs/op");
+    for (u_int i = 0; i < SCALE_COUNT && scales[i] <= max_scale; i++) {
+        bench_subscribe_channels (scales[i]);
+        bench_subscribe_one_channel (scales[i]);
+        bench_announce_channels (scales[i]);
+        bench_announce_fanout (scales[i]);
+        bench_announce_patterns (scales[i]);
+        bench_announce_wildcards (scales[i]);
+        bench_shutdown_client (scales[i]);
+        bench_process_input (scales[i]);
+        bench_announce_durable (scales[i]);
+    }
+    return 0;
+}
+
+
+//stand in for the first event loop, without sockets or an epoll set in use
+void micro_setup ()
+{
+    //failing syscalls on the fake descriptors are expected, not logged
+    debug_level = -1;
+    server_start_time = (long) time (NULL);
+
+    if ((shards = calloc (1, sizeof (struct shard))) == NULL)
+        fanout_error ("memory error");
+    current_shard = shards;
+    shards->stats = &stats;
+    shards->pools = pools;
+    if ((epollfd = epoll_create1 (0)) == -1)
+        fanout_error ("epoll_create");
+
+    //output is queued as it is inside an event loop pass, micro_sink then
+    //drops it in place of the socket writes
+    batching = 1;
+}
+
+
+uint64_t micro_now ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void micro_report (const char *name, u_int scale, unsigned long long ops,
+                   uint64_t elapsed, unsigned long long allocated)
+{
+    printf ("%-36s %8u %10.1f %10.2f\n", name, scale,
+             (double) elapsed / ops, (double) allocated / ops);
+}
+
+
+//a client with no socket, subscribed to "all" like a new connection
+struct client *micro_client ()
+{
+    struct client *c;
+
+    if ((c = pool_alloc (&pools[POOL_CLIENT])) == NULL)
+        fanout_error ("memory error");
+    c->type = FD_TYPE_CLIENT;
+    c->fd = -1;
+    c->next = client_head;
+    if (client_head != NULL)
+        client_head->previous = c;
+    client_head = c;
+    __atomic_add_fetch (&current_client_count, 1, __ATOMIC_RELAXED);
+    subscribe (c, "all", 3);
+    return c;
+}
+
+
+void micro_shutdown_all ()
+{
+    micro_sink ();
+    while (client_head != NULL)
+        shutdown_client (client_head);
+}
+
+
+//drop the queued output of every client as if it had been written
+void micro_sink ()
+{
+    while (flush_head != NULL) {
+        struct client *c = flush_head;
+        struct output_queue *q = &c->output_queue;
+
+        flush_head = c->flush_next;
+        c->flush_pending = 0;
+        while (q->count > 0) {
+            message_release (q->messages[q->start]);
+            q->start = (q->start + 1) & (q->size - 1);
+            q->count--;
+        }
+        q->offset = 0;
+        q->length = 0;
+    }
+}
+
+
+char *micro_name (char *buffer, const char *prefix, u_int i)
+{
+    sprintf (buffer, "%s.%u", prefix, i);
+    return buffer;
+}
+
+
+//every client subscribes to a channel of its own, creating it
+void bench_subscribe_channels (u_int scale)
+{
+    struct client **clients;
+    char name[32];
+    unsigned long long allocated;
+    uint64_t start;
+
+    if ((clients = malloc (scale * sizeof (struct client *))) == NULL)
+        fanout_error ("memory error");
+    for (u_int i = 0; i < scale; i++) {
+        clients[i] = micro_client ();
+    }
+
+    allocated = allocations;
+    start = micro_now ();
+    for (u_int i = 0; i < scale; i++) {
+        micro_name (name, "bench", i);
+        subscribe (clients[i], name, strlen (name));
+    }
+    micro_report ("subscribe, new channel each", scale, scale,
+                  micro_now () - start, allocations - allocated);
+
+    allocated = allocations;
+    start = micro_now ();
+    for (u_int i = 0; i < scale; i++) {
+        micro_name (name, "bench", i);
+        unsubscribe (clients[i], name, strlen (name));
+    }
+    micro_report ("unsubscribe, removing the channel", scale, scale,
+                  micro_now () - start, allocations - allocated);
+
+    free (clients);
+    micro_shutdown_all ();
+}
+
+
+//every client subscribes to the same channel
+void bench_subscribe_one_channel (u_int scale)
+{
+    struct client **clients;
+    unsigned long long allocated;
+    uint64_t start;
+
+    if ((clients = malloc (scale * sizeof (struct client *))) == NULL)
+        fanout_error ("memory error");
+    for (u_int i = 0; i < scale; i++) {
+        clients[i] = micro_client ();
+    }
+
+    allocated = allocations;
+    start = micro_now ();
+    for (u_int i = 0; i < scale; i++) {
+        subscribe (clients[i], "bench", 5);
+    }
+    micro_report ("subscribe, shared channel", scale, scale,
+                  micro_now () - start, allocations - allocated);
+
+    allocated = allocations;
+    start = micro_now ();
+    for (u_int i = 0; i < scale; i++) {
+        unsubscribe (clients[i], "bench", 5);
+    }
+    micro_report ("unsubscribe, shared channel", scale, scale,
+                  micro_now () - start, allocations - allocated);
+
+    free (clients);
+    micro_shutdown_all ();
+}
+
+
+//announcements spread over scale channels of one subscriber each
+void bench_announce_channels (u_int scale)
+{
+    char name[32];
+    unsigned long long ops = scale < MIN_OPS ? MIN_OPS : scale;
+    unsigned long long allocated;
+    uint64_t start;
+
+    for (u_int i = 0; i < scale; i++) {
+        micro_name (name, "bench", i);
+        subscribe (micro_client (), name, strlen (name));
+        //the first message sizes the output queue, keep that out of the run
+        announce (name, strlen (name), "hello world", 11);
+        micro_sink ();
+    }
+
+    allocated = allocations;
+    start = micro_now ();
+    for (unsigned long long i = 0; i < ops; i++) {
+        micro_name (name, "bench", i % scale);
+        announce (name, strlen (name), "hello world", 11);
+        micro_sink ();
+    }
+    micro_report ("announce, one of N channels", scale, ops,
+                  micro_now () - start, allocations - allocated);
+
+    micro_shutdown_all ();
+}
+
+
+//announcements to one channel with scale subscribers
+void bench_announce_fanout (u_int scale)
+{
+    unsigned long long ops = MIN_OPS / scale ? MIN_OPS / scale : 1;
+    unsigned long long allocated;
+    uint64_t start;
+
+    for (u_int i = 0; i < scale; i++) {
+        subscribe (micro_client (), "bench", 5);
+    }
+    announce ("bench", 5, "hello world", 11);
+    micro_sink ();
+
+    allocated = allocations;
+    start = micro_now ();
+    for (unsigned long long i = 0; i < ops; i++) {
+        announce ("bench", 5, "hello world", 11);
+        micro_sink ();
+    }
+    micro_report ("announce, N subscribers", scale, ops,
+                  micro_now () - start, allocations - allocated);
+
+    micro_shutdown_all ();
+}
+
+
+//scale patterns of one subscriber, announcements matching one of them or
+//none, neither should depend on how many there are
+void bench_announce_patterns (u_int scale)
+{
+    struct client *c = micro_client ();
+    char name[48];
+    unsigned long long ops = scale < MIN_OPS ? MIN_OPS : scale;
+    unsigned long long allocated;
+    uint64_t start;
+
+    allocated = allocations;
+    start = micro_now ();
+    for (u_int i = 0; i < scale; i++) {
+        sprintf (name, "bench.%u.*", i);
+        psubscribe (c, name, strlen (name));
+    }
+    micro_report ("psubscribe, new pattern each", scale, scale,
+                  micro_now () - start, allocations - allocated);
+
+    announce ("bench.0.x", 9, "hello world", 11);
+    micro_sink ();
+
+    allocated = allocations;
+    start = micro_now ();
+    for (unsigned long long i = 0; i < ops; i++) {
+        sprintf (name, "bench.%u.x", (u_int) (i % scale));
+        announce (name, strlen (name), "hello world", 11);
+        micro_sink ();
+    }
+    micro_report ("announce, one of N patterns matching", scale, ops,
+                  micro_now () - start, allocations - allocated);
+
+    allocated = allocations;
+    start = micro_now ();
+    for (unsigned long long i = 0; i < ops; i++) {
+        sprintf (name, "other.%u.x", (u_int) (i % scale));
+        announce (name, strlen (name), "hello world", 11);
+    }
+    micro_report ("announce, none of N patterns matching", scale, ops,
+                  micro_now () - start, allocations - allocated);
+
+    micro_shutdown_all ();
+}
+
+
+//announcements on a channel of scale segments, capped at
+//PATTERN_MAX_SEGMENTS, to a run of '#' and to '#' and '*' taken in turn
+//that does not match, each trie node is tried once per segment
+void bench_announce_wildcards (u_int scale)
+{
+    u_int segments = scale < PATTERN_MAX_SEGMENTS ? scale
+                                                   : PATTERN_MAX_SEGMENTS;
+    char channel[PATTERN_MAX_SEGMENTS * 2];
+    char pattern[PATTERN_MAX_SEGMENTS * 2 + 2];
+    unsigned long long allocated;
+    uint64_t start;
+
+    //larger scales would repeat the capped case
+    if (scale > 1000)
+        return;
+
+    for (u_int i = 0; i < segments; i++) {
+        memcpy (channel + i * 2, "s.", 2);
+        memcpy (pattern + i * 2, i % 2 ? "*." : "#.", 2);
+    }
+    channel[segments * 2 - 1] = '\0';
+    strcpy (pattern + (segments - 1) * 2, "x");
+
+    psubscribe (micro_client (), "#.#.#.#.#.#.#.#.#.#", 19);
+    psubscribe (micro_client (), pattern, strlen (pattern));
+    announce (channel, strlen (channel), "hello world", 11);
+    micro_sink ();
+
+    allocated = allocations;
+    start = micro_now ();
+    for (unsigned long long i = 0; i < MIN_OPS / 10; i++) {
+        announce (channel, strlen (channel), "hello world", 11);
+        micro_sink ();
+    }
+    micro_report ("announce, '#' patterns on N segments", segments,
+                  MIN_OPS / 10, micro_now () - start,
+                  allocations - allocated);
+
+    micro_shutdown_all ();
+}
+
+
+//disconnecting clients with a few subscriptions each, the socket calls
+//fail straight away on the fake descriptors
+void bench_shutdown_client (u_int scale)
+{
+    char name[32];
+    unsigned long long allocated;
+    uint64_t start;
+
+    for (u_int i = 0; i < scale; i++) {
+        struct client *c = micro_client ();
+        subscribe (c, "bench", 5);
+        subscribe (c, micro_name (name, "bench", i), strlen (name));
+    }
+
+    allocated = allocations;
+    start = micro_now ();
+    while (client_head != NULL)
+        shutdown_client (client_head);
+    micro_report ("shutdown_client, 3 subscriptions", scale, scale,
+                  micro_now () - start, allocations - allocated);
+}
+
+
+//parsing scale buffered announce lines for a channel nobody subscribes to
+void bench_process_input (u_int scale)
+{
+    static const char line[] = "announce bench.nobody hello world\n";
+    size_t length = scale * (sizeof (line) - 1);
+    struct client *c = micro_client ();
+    unsigned long long allocated;
+    uint64_t start;
+
+    if ((c->input.data = malloc (length + 1)) == NULL)
+        fanout_error ("memory error");
+    for (u_int i = 0; i < scale; i++) {
+        memcpy (c->input.data + i * (sizeof (line) - 1), line,
+                sizeof (line) - 1);
+    }
+    c->input.data[length] = '\0';
+    c->input.size = length + 1;
+    c->input.length = length;
+
+    allocated = allocations;
+    start = micro_now ();
+    client_process_input_buffer (c);
+    micro_report ("client_process_input_buffer, per line", scale, scale,
+                  micro_now () - start, allocations - allocated);
+
+    micro_shutdown_all ();
+}
+
+
+//announcements to a journaled channel whose subscriber's capped output is
+//written out in the middle of the batch, each write syncing the journal
+//first; fanout-check checks that ordering
+void bench_announce_durable (u_int scale)
+{
+    char dir[] = "/tmp/fanout-micro.XXXXXX";
+    char name[32];
+    char payload[32];
+    char buffer[65536];
+    unsigned long long allocated;
+    uint64_t start;
+    int sockets[2];
+    struct client *c;
+    struct dirent *entry;
+    DIR *d;
+
+    if (mkdtemp (dir) == NULL)
+        fanout_error ("mkdtemp");
+    if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sockets) == -1)
+        fanout_error ("socketpair");
+    journal.dir = dir;
+    history_messages = 16;
+    max_output_buffer = 4096;
+    journal_open ();
+
+    //channels holding history outlive the run, so each scale has its own
+    micro_name (name, "durable", scale);
+    c = micro_client ();
+    c->fd = sockets[0];
+    subscribe (c, name, strlen (name));
+
+    allocated = allocations;
+    start = micro_now ();
+    for (u_int i = 0; i < scale; i++) {
+        sprintf (payload, "%u", i);
+        announce (name, strlen (name), payload, strlen (payload));
+
+        //keep the subscriber from becoming a slow consumer
+        while (read (sockets[1], buffer, sizeof (buffer)) > 0)
+            ;
+    }
+    micro_report ("announce, journaled with capped output", scale, scale,
+                  micro_now () - start, allocations - allocated);
+
+    micro_sink ();
+    micro_shutdown_all ();
+    close (sockets[1]);
+    journal_seal ();
+    if ((d = opendir (dir)) == NULL)
+        fanout_error ("opendir");
+    while ((entry = readdir (d)) != NULL) {
+        if (entry->d_name[0] != '.')
+            unlinkat (dirfd (d), entry->d_name, 0);
+    }
+    closedir (d);
+    rmdir (dir);
+    free (journal.channels);
+    for (u_int i = 0; i < journal.segment_count; i++) {
+        free (journal.segments[i].summary);
+    }
+    free (journal.segments);
+    journal = (struct journal) { .fd = -1 };
+    history_messages = 0;
+    max_output_buffer = 0;
+}
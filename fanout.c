@@ -28,24 +28,538 @@
 #include <sys/resource.h>
 #include <errno.h>
 #include <sys/epoll.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#endif
+
+
+//announcement routing table lock stripes, must be a power of 2
+#define INTEREST_STRIPES 64
+#define INTEREST_OFFLINE UINT64_MAX
+
+//segments in a pattern, and in a channel for it to be matched against
+//patterns, every walk over the trie is bounded by nodes times segments
+#define PATTERN_MAX_SEGMENTS 64
+
+//log records queued for the writer thread, must be a power of 2
+#define LOG_RING_SIZE 8192
+
+//check the level before anything is formatted or any argument evaluated
+#define fanout_debug(level, ...) \
+    do { \
+        if (debug_level >= (level)) \
+            fanout_log ((level), __VA_ARGS__); \
+    } while (0)
+
+//stages are only timed during the sampled passes of the event loop
+#define trace_begin(stage) \
+    do { \
+        if (trace_active) \
+            trace_push (stage); \
+    } while (0)
+#define trace_end() \
+    do { \
+        if (trace_active) \
+            trace_pop (); \
+    } while (0)
+
+//static tracepoints for perf and bpftrace, built with -DHAVE_SDT
+#ifdef HAVE_SDT
+#define fanout_probe2(name, a, b) DTRACE_PROBE2 (fanout, name, a, b)
+#define fanout_probe3(name, a, b, c) DTRACE_PROBE3 (fanout, name, a, b, c)
+#else
+#define fanout_probe2(name, a, b) do { } while (0)
+#define fanout_probe3(name, a, b, c) do { } while (0)
+#endif
+
+
+//how event loops share incoming connections
+enum listen_mode
+{
+    //a listener per event loop, the kernel spreads connections across them
+    LISTEN_REUSEPORT,
+    //one set of listeners watched by every event loop, one is woken
+    LISTEN_EXCLUSIVE
+};
+
+
+//how an event loop learns about and performs socket io
+enum io_backend
+{
+    //readiness from epoll, then a recv or sendmsg call per socket
+    IO_BACKEND_EPOLL,
+    //accepts, receives and sends completed by the kernel on a ring
+    IO_BACKEND_URING
+};
+
+
+//what to do with a client whose output queue would exceed
+//max_output_buffer
+enum slow_consumer_policy
+{
+    POLICY_DISCONNECT,
+    POLICY_DROP_OLDEST,
+    POLICY_DROP_NEWEST,
+    POLICY_COALESCE
+};
+
+
+//binary protocol frame header: opcode, flags, channel length (2 bytes) and
+//payload length (4 bytes), lengths in network byte order
+#define FRAME_HEADER_LENGTH 8
+//the header is followed by the 8 byte sequence number of the message
+#define FRAME_FLAG_SEQ 0x01
+
+enum frame_opcode
+{
+    FRAME_ANNOUNCE = 1,
+    FRAME_SUBSCRIBE = 2,
+    FRAME_UNSUBSCRIBE = 3,
+    FRAME_PING = 4,
+    FRAME_INFO = 5,
+    //a channel message delivered to a subscriber
+    FRAME_MESSAGE = 6,
+    FRAME_PSUBSCRIBE = 7,
+    FRAME_PUNSUBSCRIBE = 8,
+    //ends a replay, the payload holds the first and last sequence numbers
+    FRAME_REPLAYED = 9,
+    FRAME_TRACE = 10
+};
+
+
+//every structure registered with epoll starts with its type so that events
+//can be dispatched straight from the epoll data pointer
+enum fd_type
+{
+    FD_TYPE_LISTENER,
+    FD_TYPE_CLIENT,
+    FD_TYPE_INBOX,
+    FD_TYPE_METRICS_LISTENER,
+    FD_TYPE_METRICS,
+    FD_TYPE_METRICS_TIMER,
+    FD_TYPE_SIGNAL
+};
+
+
+//parts of the event loop timed separately, each stage's time excludes the
+//stages it calls into
+enum trace_stage
+{
+    TRACE_ACCEPT,
+    TRACE_READ,
+    TRACE_PARSE,
+    TRACE_SUBSCRIBE,
+    TRACE_ANNOUNCE,
+    TRACE_LOOKUP,
+    TRACE_FANOUT,
+    TRACE_INBOX,
+    TRACE_JOURNAL,
+    TRACE_FLUSH,
+    TRACE_CLOSE,
+    TRACE_STAGE_COUNT
+};
+
+
+//stages in progress, the deepest nesting is parse, announce, lookup
+#define TRACE_DEPTH 8
+
+struct trace_frame
+{
+    enum trace_stage stage;
+    uint64_t start;
+    //time spent in the stages called from this one
+    uint64_t nested;
+};
+
+
+//a descriptor watched for signals instead of a handler
+struct signal_source
+{
+    enum fd_type type;
+    int fd;
+};
+
+
+struct timer_source
+{
+    enum fd_type type;
+    int fd;
+};
+
+
+//immutable, reference counted payload shared by every client it is
+//queued for
+struct message
+{
+    u_int refcount;
+    size_t length;
+    //length of the channel!message channel prefix, 0 for direct replies
+    size_t channel_length;
+    //where the channel starts in data, past the header of binary frames
+    size_t channel_offset;
+    //position in the channel history, 0 when not recorded
+    unsigned long long seq;
+    //set when the channel or message could not have been announced over
+    //the text protocol, only binary subscribers receive it
+    u_char binary_only;
+    char data[];
+};
+
+
+//last messages announced on a channel, oldest first
+struct history
+{
+    struct message **messages;
+    u_int size;
+    u_int start;
+    u_int count;
+    size_t length;
+    //sequence number of the newest message announced
+    unsigned long long seq;
+};
+
+
+//fixed size objects carved out of aligned slabs, a freed object goes to
+//the front of its slab's free list so the next allocation reuses memory
+//that is likely still cached
+#define POOL_SLAB_SIZE (64 * 1024)
+#define POOL_ALIGN(size) (((size) + 15) & ~((size_t) 15))
+#define POOL_HEADER_SIZE POOL_ALIGN (sizeof (struct pool_slab))
+#define POOL_INITIALIZER(type) { POOL_ALIGN (sizeof (type)), \
+    (POOL_SLAB_SIZE - POOL_HEADER_SIZE) / POOL_ALIGN (sizeof (type)), \
+    NULL, NULL, 0, 0 }
+
+enum pool_type {
+    POOL_CLIENT,
+    POOL_SUBSCRIPTION,
+    POOL_CHANNEL,
+    POOL_COUNT
+};
+
+
+struct pool_slab
+{
+    //slabs with free objects
+    struct pool_slab *next;
+    struct pool_slab *previous;
+    void *free_head;
+    u_int used;
+    //objects handed out from the untouched end of the slab so far
+    u_int carved;
+};
+
+
+struct pool
+{
+    size_t object_size;
+    u_int slab_objects;
+    //slabs with free objects, allocations come from the first
+    struct pool_slab *partial;
+    //one empty slab kept back so churn at a boundary doesn't remap
+    struct pool_slab *spare;
+    u_int slab_count;
+    u_int used;
+};
+
+
+//ring of queued message references, oldest first
+struct output_queue
+{
+    struct message **messages;
+    u_int size;
+    u_int start;
+    u_int count;
+    //bytes of the oldest message already sent
+    size_t offset;
+    //unsent bytes across the whole queue, less a send in flight on the ring
+    size_t length;
+};
+
+
+//bytes received from a client that have not been parsed into lines yet
+struct input_buffer
+{
+    char *data;
+    size_t size;
+    //bytes at the front of data already parsed
+    size_t start;
+    //unparsed bytes following start, data stays NUL terminated after them
+    size_t length;
+};
+
+
+struct listener
+{
+    enum fd_type type;
+    int fd;
+};
+
+
+//an HTTP connection to the metrics port, answered once and closed
+#define METRICS_REQUEST_SIZE 2048
+//connections open at once, covered by the descriptors kept out of
+//client_limit, further ones are closed straight away
+#define METRICS_MAX_CLIENTS 4
+//seconds a connection has to send its request in
+#define METRICS_TIMEOUT 5
+
+struct metrics_client
+{
+    enum fd_type type;
+    int fd;
+    time_t connected;
+    struct metrics_client *next;
+    struct metrics_client *previous;
+    char request[METRICS_REQUEST_SIZE];
+    size_t request_length;
+    char *response;
+    size_t response_length;
+    size_t sent;
+};
 
 
 struct client
 {
+    enum fd_type type;
     int fd;
-    char *input_buffer;
-    char *output_buffer;
+    struct input_buffer input;
+    //messages not yet accepted by the socket, flushed on EPOLLOUT
+    struct output_queue output_queue;
+    //set once the client switched to length prefixed frames
+    int binary;
+    //last announcement delivered, so overlapping subscriptions deliver once
+    unsigned long long delivered_epoch;
+    //lines still expected after mannounce <count>
+    u_int announce_lines;
+    //set while EPOLLOUT is part of the watched events
+    int watching_output;
+    //queued output written once the current batch of events is handled
+    int flush_pending;
+    struct client *flush_next;
+    //set once the client is queued for disconnection
+    int closing;
+    struct client *close_next;
+    //subscriptions held by this client only
+    struct subscription *subscription_head;
+    u_int subscription_count;
     struct client *next;
     struct client *previous;
+    //io_uring backend: the send in flight, set while a multishot receive
+    //is armed, and set once destroyed while the ring still refers to it
+    struct uring_send *send;
+    int receiving;
+    int released;
+};
+
+
+//io_uring backend, the submission queue of each event loop and the
+//provided buffers its receives pick from
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 4096
+//messages gathered per send, a send completes once per pass so this bounds
+//what a client is sent per pass
+#define URING_SEND_MESSAGES 256
+//messages at least this large on average are sent without copying into
+//the socket, pinning pages costs more than copying small ones
+#define URING_ZEROCOPY_MIN (16 * 1024)
+//what a completion is for, kept in the low bits of its user_data
+#define URING_TAG_MASK 7
+
+enum uring_tag
+{
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_POLL,
+    URING_CANCEL
+};
+
+
+struct uring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    //cleared once the kernel refuses zero copy sends
+    int zerocopy;
+};
+
+
+//a sendmsg in flight, holding a reference to every message it covers until
+//the kernel is done with their memory
+struct uring_send
+{
+    //NULL once the result is in or the client went away
+    struct client *client;
+    //next on the free list
+    struct uring_send *next;
+    struct msghdr msg;
+    struct iovec iov[URING_SEND_MESSAGES];
+    struct message *messages[URING_SEND_MESSAGES];
+    u_int count;
+    //bytes sent, taken off the output queue length meanwhile
+    size_t length;
+    int zerocopy;
 };
 
 
+//channel names up to this long live inside the channel
+#define CHANNEL_INLINE_NAME 40
+
 struct channel
 {
     char *name;
+    size_t name_length;
+    u_int hash;
+    //pattern subscriptions live in the pattern trie instead of the table
+    struct pattern_node *pattern;
+    //hash bucket chain
     struct channel *next;
     struct channel *previous;
+    //subscriptions to this channel only
+    struct subscription *subscription_head;
     u_int subscription_count;
+    struct history history;
+    //names that fit are kept inline, name points here
+    char inline_name[CHANNEL_INLINE_NAME];
+    //entry in the journal summary of segment journal_number
+    u_int journal_entry;
+    unsigned long long journal_number;
+    //idle list, channels kept only for their history
+    struct channel *idle_next;
+    struct channel *idle_previous;
+    u_char idle;
+};
+
+
+//journal segments are files of records preceded by a header page, a
+//sealed segment ends with a summary of the channels it holds so restarts
+//only read headers and summaries
+#define JOURNAL_HEADER_SIZE 4096
+#define JOURNAL_MAGIC "FANOUTJ1"
+#define JOURNAL_ALIGN(length) (((length) + 7) & ~((size_t) 7))
+
+struct journal_header
+{
+    char magic[8];
+    uint64_t number;
+    //bytes of records known to be on disk
+    uint64_t committed;
+    uint64_t record_count;
+    uint64_t summary_offset;
+    uint64_t summary_length;
+    uint32_t sealed;
+};
+
+
+//followed by the message as sent to text subscribers, <channel>!<message>
+struct journal_record
+{
+    uint64_t seq;
+    uint32_t length;
+    uint32_t channel_length;
+    char data[];
+};
+
+
+//followed by the channel name
+struct journal_summary
+{
+    uint64_t last_seq;
+    uint32_t count;
+    uint32_t channel_length;
+};
+
+
+//channel totals of the open segment, written out as its summary
+struct journal_channel
+{
+    char *name;
+    size_t name_length;
+    unsigned long long last_seq;
+    u_int count;
+};
+
+
+struct journal_segment
+{
+    unsigned long long number;
+    char *summary;
+    size_t summary_length;
+    int needed;
+};
+
+
+struct journal
+{
+    char *dir;
+    int fd;
+    char *map;
+    //bytes available for records in the open segment
+    size_t map_length;
+    unsigned long long number;
+    //bytes of records appended, and of those the ones on disk
+    size_t tail;
+    size_t synced;
+    uint64_t record_count;
+    struct journal_channel *channels;
+    u_int channel_count;
+    u_int channel_size;
+    //sealed segments still holding history, oldest first
+    struct journal_segment *segments;
+    u_int segment_count;
+    u_int segment_size;
+    unsigned long long commit_count;
+    unsigned long long recovered_count;
+    unsigned long long removed_count;
+};
+
+
+//one segment of a pattern, literal children are found through
+//pattern_table by parent and segment, wildcards hang off their parent
+struct pattern_node
+{
+    struct pattern_node *parent;
+    char *segment;
+    size_t segment_length;
+    u_int hash;
+    //pattern_table bucket chain
+    struct pattern_node *next;
+    struct pattern_node *previous;
+    //'*' matches exactly one segment, '#' any number of segments
+    struct pattern_node *wildcard_one;
+    struct pattern_node *wildcard_many;
+    u_int child_count;
+    //subscriptions to the pattern ending at this node
+    struct channel *channel;
+    //channel segment indexes the node was tried at during walk, each is
+    //tried once since what follows from there is the same every time
+    unsigned long long walk;
+    uint64_t visited[PATTERN_MAX_SEGMENTS / 64 + 1];
 };
 
 
@@ -53,93 +567,579 @@ struct subscription
 {
     struct client *client;
     struct channel *channel;
-    struct subscription *next;
-    struct subscription *previous;
+    //position within the client's own subscription list
+    struct subscription *client_next;
+    struct subscription *client_previous;
+    //position within the channel's own subscription list
+    struct subscription *channel_next;
+    struct subscription *channel_previous;
+};
+
+
+struct inbox_item
+{
+    struct inbox_item *next;
+    struct message *message;
+};
+
+
+//multi-producer single-consumer queue of announcements routed to a shard by
+//the other shards, the eventfd wakes the owning shard's event loop
+struct inbox
+{
+    enum fd_type type;
+    int fd;
+    //consumer end, only touched by the owning shard
+    struct inbox_item *head;
+    //producer end, swapped atomically by announcing shards
+    struct inbox_item *tail;
+    struct inbox_item stub;
+    //set while a wakeup is pending on fd
+    int signalled;
+};
+
+
+//bucket i counts observations up to first << i, the last bucket counts
+//everything above
+#define HISTOGRAM_BUCKETS 16
+//first bounds of histograms of counts and of durations in ns
+#define HISTOGRAM_COUNT_FIRST 1
+#define HISTOGRAM_TIME_FIRST 1000
+//stage times start lower, in ns as well
+#define HISTOGRAM_TRACE_FIRST 16
+
+struct histogram
+{
+    unsigned long long buckets[HISTOGRAM_BUCKETS + 1];
+    unsigned long long count;
+    unsigned long long sum;
+};
+
+
+//per shard statistics, summed across shards by info
+struct stats
+{
+    //announcement stats
+    unsigned long long announcements_count;
+
+    //messages stats
+    unsigned long long messages_count;
+
+    //subscription stats
+    unsigned long long subscriptions_count;
+
+    //unsubscription stats
+    unsigned long long unsubscriptions_count;
+
+    //ping stats
+    unsigned long long pings_count;
+
+    //connection/client stats
+    unsigned long long clients_count;
+
+    //over limit count
+    unsigned long long client_limit_count;
+
+    //slow consumer stats
+    unsigned long long slow_consumer_disconnects_count;
+    unsigned long long dropped_oldest_count;
+    unsigned long long dropped_newest_count;
+    unsigned long long coalesced_count;
+
+    //event loop stats
+    unsigned long long event_waits_count;
+    unsigned long long events_count;
+
+    //idle channels dropped with their history
+    unsigned long long evicted_channels_count;
+
+    //live gauges, maintained as objects are created and destroyed
+    u_int current_channel_count;
+    u_int current_subscription_count;
+    u_int current_pattern_count;
+    u_int current_history_count;
+    size_t current_history_length;
+    u_int current_idle_channel_count;
+    //connections accepted in accept_second and in the second before it
+    time_t accept_second;
+    u_int accept_second_count;
+    u_int accepts_last_second;
+    u_int max_accepts_per_second;
+    //pool occupancy, filled in by stats_total
+    u_int pool_used[POOL_COUNT];
+    u_int pool_capacity[POOL_COUNT];
+
+    //subscribers reached per announcement on this shard
+    struct histogram fanout_histogram;
+    //time spent in announce, in ns
+    struct histogram announce_histogram;
+    //messages queued for a client when its output is written
+    struct histogram output_queue_histogram;
+    //time from epoll_wait returning to the next wait, in ns
+    struct histogram loop_histogram;
+    //time per stage during sampled event loop passes, in ns
+    struct histogram trace_histograms[TRACE_STAGE_COUNT];
+};
+
+
+//an event loop thread owning its epoll instance, listeners, clients and
+//channels
+struct shard
+{
+    u_int id;
+    pthread_t thread;
+    int epollfd;
+    struct listener *listeners;
+    int listener_count;
+    struct inbox inbox;
+    struct stats *stats;
+    struct pool *pools;
+    //interest_epoch when its current pass started, INTEREST_OFFLINE
+    //between passes
+    uint64_t interest_epoch;
+};
+
+
+//which shards have subscribers for a channel, read without the stripe
+//lock by every shard announcing on it, so an unlinked entry is only freed
+//once no shard is still in a pass that may have found it
+struct interest
+{
+    size_t name_length;
+    u_int hash;
+    uint64_t shards;
+    struct interest *next;
+    //the shard's list of entries unlinked and waiting to be freed
+    struct interest *retired_next;
+    uint64_t retired_epoch;
+    char name[];
+};
+
+
+struct interest_table
+{
+    u_int size;
+    //replaced tables wait to be freed like unlinked entries
+    struct interest_table *retired_next;
+    uint64_t retired_epoch;
+    struct interest *buckets[];
+};
+
+
+struct interest_stripe
+{
+    //taken by writers only
+    pthread_mutex_t lock;
+    struct interest_table *table;
+    //odd while a resize moves entries between buckets, readers retry then
+    u_int sequence;
+    u_int count;
+};
+
+
+struct log_slot
+{
+    //matches the enqueue position while free, one past it once filled
+    size_t sequence;
+    char *record;
+};
+
+
+//bounded multi-producer queue of formatted log records, drained by the log
+//writer thread
+struct log_ring
+{
+    struct log_slot slots[LOG_RING_SIZE];
+    size_t head;
+    //only touched by the writer thread
+    size_t tail;
+    //wakes the writer, set while a wakeup is pending
+    int fd;
+    int signalled;
+    int stopping;
+    pthread_t thread;
 };
 
 
 int is_numeric (char *str);
-int strcpos (const char *haystack, const char c);
-char *substr (const char *s, int start, int stop);
-void str_swap_free (char **target, char *source);
 char *str_append (char *target, const char *data);
 void clear_socket_buffer (int sock);
+struct message *message_create (size_t length);
+struct message *message_from_string (const char *data);
+struct message *frame_create (enum frame_opcode opcode,
+                              unsigned long long seq, const char *channel,
+                              size_t channel_length, const char *payload,
+                              size_t payload_length);
+struct message *message_frame (struct message *m);
+int message_is_text (const char *channel, size_t channel_length,
+                     const char *message, size_t message_length);
+void message_retain (struct message *m);
+void message_release (struct message *m);
 void fanout_error (const char *msg);
-void fanout_debug (int level, const char *format, ...);
+void fanout_log (int level, const char *format, ...);
+void log_write (const char *record, size_t length);
+void log_rotate (void);
+int log_push (char *record);
+char *log_pop (void);
+void log_writer_start (void);
+void *log_writer_run (void *arg);
+void log_writer_stop (void);
 char *getsocketpeername (int fd);
 
-int channel_exists (const char *channel_name);
+void inbox_init (struct inbox *q);
+void inbox_push (struct inbox *q, struct inbox_item *item);
+struct inbox_item *inbox_pop (struct inbox *q);
+void shard_init (struct shard *s, u_int id);
+void shard_listen (struct shard *s, struct addrinfo *ai,
+                   u_int listen_backlog);
+void shard_watch_listeners (struct shard *s);
+void *shard_run (void *arg);
+uint64_t shard_pass_start (int nevents);
+void shard_dispatch (struct shard *s, struct epoll_event *event);
+void shard_pass_end (uint64_t loop_start);
+void accept_clients (struct listener *listener);
+void add_client (int fd, time_t now);
+void refuse_client (int fd);
+int accept_failed (struct listener *listener, int error);
+void *uring_run (struct shard *s);
+void uring_init (void);
+int uring_setup (unsigned entries, struct io_uring_params *p);
+void uring_submit (unsigned wait);
+struct io_uring_sqe *uring_sqe (void);
+void uring_complete (struct shard *s, struct io_uring_cqe *cqe);
+void uring_accept (struct listener *listener);
+void uring_accepted (struct listener *listener, struct io_uring_cqe *cqe);
+void uring_recv (struct client *c);
+void uring_received (struct client *c, struct io_uring_cqe *cqe);
+void uring_buffer_return (u_int id);
+void uring_send (struct client *c);
+void uring_sent (struct uring_send *send, struct io_uring_cqe *cqe);
+void uring_poll (struct shard *s);
+void uring_polled (struct shard *s, struct io_uring_cqe *cqe);
+void uring_cancel (struct client *c);
+void uring_client_done (struct client *c);
+void shard_process_inbox (struct shard *s);
+void stats_total (struct stats *total);
+void histogram_observe (struct histogram *h, unsigned long long first,
+                        unsigned long long value);
+void histogram_add (struct histogram *total, struct histogram *h);
+uint64_t monotonic_ns (void);
+uint64_t trace_now (void);
+void trace_push (enum trace_stage stage);
+void trace_pop (void);
+char *trace_report (void);
+unsigned long long histogram_percentile (struct histogram *h,
+                                         unsigned long long first,
+                                         double fraction);
+void trace_signal_init (void);
+void trace_signal_read (void);
+int listen_socket (struct addrinfo *runp, u_int listen_backlog);
+void metrics_listen (struct addrinfo *ai);
+void metrics_accept (struct listener *listener);
+void metrics_read (struct metrics_client *mc);
+void metrics_respond (struct metrics_client *mc);
+void metrics_write (struct metrics_client *mc);
+void metrics_close (struct metrics_client *mc);
+void metrics_timer_arm (int armed);
+void metrics_expire (void);
+void metrics_render (FILE *out);
+void metrics_counter (FILE *out, const char *name, const char *help,
+                      unsigned long long value);
+void metrics_gauge (FILE *out, const char *name, const char *help,
+                    double value);
+void metrics_histogram (FILE *out, const char *name, const char *help,
+                        struct histogram *h, unsigned long long first,
+                        double scale);
+void *pool_alloc (struct pool *p);
+void pool_free (struct pool *p, void *object);
+struct pool_slab *pool_slab_create (struct pool *p);
+void pool_slab_link (struct pool *p, struct pool_slab *slab);
+void pool_slab_unlink (struct pool *p, struct pool_slab *slab);
+void interest_add (const char *channel_name, size_t channel_length,
+                   u_int hash, u_int shard_id);
+void interest_remove (const char *channel_name, size_t channel_length,
+                      u_int hash, u_int shard_id);
+uint64_t interest_get (const char *channel_name, size_t channel_length,
+                       u_int hash);
+u_int interest_count (void);
+void interest_reclaim (void);
+
+u_int channel_hash (const char *channel_name, size_t channel_length);
+void channel_table_resize (u_int size);
+struct channel *find_channel (const char *channel_name,
+                              size_t channel_length);
 int channel_has_subscription (struct channel *c);
-struct channel *get_channel (const char *channel_name);
+struct channel *get_channel (const char *channel_name,
+                             size_t channel_length);
 void remove_channel (struct channel *c);
 void destroy_channel (struct channel *c);
-u_int channel_count (void);
+void channel_set_name (struct channel *c, const char *name, size_t length);
+void history_push (struct channel *c, struct message *m);
+void history_drop_oldest (struct channel *c);
+void history_replay (struct client *c, struct channel *channel,
+                     unsigned long long since);
+void channel_idle (struct channel *c);
+void channel_busy (struct channel *c);
+void evict_idle_channels (void);
+
+int channel_durable (const char *channel_name, size_t channel_length);
+char *journal_path (unsigned long long number);
+int journal_segment_compare (const void *a, const void *b);
+void journal_open (void);
+void journal_load_summary (struct journal_segment *segment);
+void journal_restore (struct journal_segment *segments, u_int count);
+void journal_segment_create (size_t length);
+void journal_append (struct channel *c, struct message *m);
+void journal_count (struct channel *c, unsigned long long seq);
+void journal_commit (void);
+void journal_commit_pending (void);
+void journal_seal (void);
+char *journal_write_summary (int fd, struct journal_header *header);
+void journal_keep (unsigned long long number, char *summary,
+                   size_t summary_length);
+void journal_collect (void);
+void journal_sync_dir (void);
+
+u_int pattern_hash (struct pattern_node *parent, const char *segment,
+                    size_t segment_length);
+void pattern_table_resize (u_int size);
+struct pattern_node *find_pattern_child (struct pattern_node *parent,
+                                         const char *segment,
+                                         size_t segment_length);
+struct pattern_node *find_pattern (const char *pattern,
+                                   size_t pattern_length, int create);
+struct channel *get_pattern_channel (const char *pattern,
+                                     size_t pattern_length);
+void remove_pattern (struct channel *c);
+u_int pattern_segments (const char *name, size_t name_length);
+int pattern_visit (struct pattern_node *node, u_int segment);
+void pattern_match (const char *channel_name, size_t channel_length,
+                    struct message *m, struct message **frame);
+void pattern_match_node (struct pattern_node *node, const char *channel_name,
+                         size_t channel_length, size_t position,
+                         u_int segment, struct message *m,
+                         struct message **frame);
+int pattern_matches (const char *channel_name, size_t channel_length);
+int pattern_matches_node (struct pattern_node *node, const char *channel_name,
+                          size_t channel_length, size_t position,
+                          u_int segment);
 
 
-struct client *get_client (int fd);
 void remove_client (struct client *c);
 void shutdown_client (struct client *c);
 void destroy_client (struct client *c);
 void client_write (struct client *c, const char *data);
+void client_write_message (struct client *c, struct message *m);
+void client_queue_message (struct client *c, struct message *m,
+                           size_t offset);
+void client_flush (struct client *c);
+void output_queue_advance (struct output_queue *q, size_t sent);
+void client_watch_output (struct client *c, int enable);
+int client_make_room (struct client *c, struct message *m, size_t length);
+void client_close_later (struct client *c);
+void close_pending_clients (void);
+void client_flush_later (struct client *c);
+void flush_pending_clients (void);
+ssize_t client_read (struct client *c, int *eof);
+void input_reserve (struct input_buffer *in, size_t length);
+void input_append (struct input_buffer *in, const char *data, size_t length);
 void client_process_input_buffer (struct client *c);
-u_int client_count (void);
+void client_ping (struct client *c);
+void client_info (struct client *c);
+void client_trace (struct client *c);
+void client_process_frames (struct client *c);
+void client_reply (struct client *c, enum frame_opcode opcode,
+                   const char *data);
+char *line_token (char **cursor, char *end);
 
 
 struct subscription *get_subscription (struct client *c,
                                         struct channel *channel);
 void remove_subscription (struct subscription *s);
 void destroy_subscription (struct subscription *s);
-u_int subscription_count (void);
-
-
-void announce (const char *channel_name, const char *message);
-void subscribe (struct client *c, const char *channel_name);
-void unsubscribe (struct client *c, const char *channel_name);
+void end_subscription (struct subscription *s);
+
+
+void announce (const char *channel_name, size_t channel_length,
+               const char *message, size_t message_length);
+void deliver_local (const char *channel_name, size_t channel_length,
+                    struct message *m);
+void deliver_message (struct channel *channel, struct message *m,
+                      struct message **frame);
+void route_message (struct message *m, uint64_t mask);
+void subscribe (struct client *c, const char *channel_name,
+                size_t channel_length);
+void unsubscribe (struct client *c, const char *channel_name,
+                  size_t channel_length);
+void psubscribe (struct client *c, const char *pattern,
+                 size_t pattern_length);
+void punsubscribe (struct client *c, const char *pattern,
+                   size_t pattern_length);
+int subscribe_channel (struct client *c, struct channel *channel);
+void subscribe_since (struct client *c, const char *channel_name,
+                      size_t channel_length, unsigned long long since);
+void unsubscribe_channel (struct client *c, struct channel *channel);
 
 
 // GLOBAL VARS
 u_int max_client_count = 0;
+
+//connected clients across all shards, updated atomically
+u_int current_client_count = 0;
+
 u_int base_fds = 0;
 u_int fd_limit = 0;
 int client_limit = -1;
 long server_start_time;
+u_int max_events = 25;
+//bytes read from one client per readable event before moving on
+size_t read_budget = 65536;
+
+//event loop threads
+u_int shard_count = 1;
+struct shard *shards = NULL;
+struct interest_stripe interest_stripes[INTEREST_STRIPES];
+//bumped as interest entries and tables are retired
+uint64_t interest_epoch = 0;
+
+//per shard state, owned by the thread running that shard's event loop
+__thread struct shard *current_shard = NULL;
+__thread struct stats stats;
+__thread int epollfd;
+__thread char ipstr[INET6_ADDRSTRLEN];
+//kept open to take and refuse a connection once descriptors run out
+__thread int reserve_fd = -1;
+//unlinked by this shard, newest first
+__thread struct interest *retired_interests = NULL;
+__thread struct interest_table *retired_tables = NULL;
+//last second an accept failure was logged
+__thread time_t accept_error_second = 0;
+
+//per channel history kept for replay, off while history_messages is 0
+u_int history_messages = 0;
+size_t history_bytes = 0;
+//channels kept without subscribers for their history, 0 = unlimited
+u_int history_channels = 65536;
+
+//durable channels are journaled to disk and their history restored on
+//startup, the journal is owned by the single event loop
+struct journal journal = { .fd = -1 };
+size_t journal_segment_size = 64 * 1024 * 1024;
+char *durable_prefix = "";
+size_t durable_prefix_length = 0;
+
+//per client cap on queued output in bytes, 0 = unlimited
+size_t max_output_buffer = 0;
+enum listen_mode listen_mode = LISTEN_REUSEPORT;
+const char *listen_mode_names[] = {
+    "reuseport",
+    "exclusive"
+};
+u_int listen_backlog = SOMAXCONN;
+enum io_backend io_backend = IO_BACKEND_EPOLL;
+const char *io_backend_names[] = {
+    "epoll",
+    "io_uring"
+};
 
-char ipstr[INET6_ADDRSTRLEN];
-
-//announcement stats
-unsigned long long announcements_count = 0;
-
-//messages stats
-unsigned long long messages_count = 0;
-
-//subscription stats
-unsigned long long subscriptions_count = 0;
-
-//unsubscription stats
-unsigned long long unsubscriptions_count = 0;
-
-//ping stats
-unsigned long long pings_count = 0;
-
-//connection/client stats
-unsigned long long clients_count = 0;
-
-//over limit count
-unsigned long long client_limit_count = 0;
+//stats served over HTTP by the first event loop, off while the port is 0
+int metrics_port = 0;
+struct listener *metrics_listeners = NULL;
+int metrics_listener_count = 0;
+struct metrics_client *metrics_clients = NULL;
+u_int metrics_client_count = 0;
+//ticks every second while metrics clients are connected
+struct timer_source metrics_timer = { FD_TYPE_METRICS_TIMER, -1 };
+
+//one event loop pass in trace_sample is traced, 0 = off
+u_int trace_sample = 64;
+const char *trace_stage_names[] = {
+    "accept",
+    "read",
+    "parse",
+    "subscribe",
+    "announce",
+    "lookup",
+    "fanout",
+    "inbox",
+    "journal",
+    "flush",
+    "close"
+};
+//SIGUSR1 logs the trace report
+struct signal_source trace_signal = { FD_TYPE_SIGNAL, -1 };
+
+enum slow_consumer_policy slow_consumer_policy = POLICY_DISCONNECT;
+const char *slow_consumer_policy_names[] = {
+    "disconnect",
+    "drop-oldest",
+    "drop-newest",
+    "coalesce"
+};
 
 static int daemonize =  0;
 
 FILE *logfile;
+char *logfile_name = NULL;
+long logfile_size = 0;
 long max_logfile_size = -1;
+int max_logfiles = 5;
+struct log_ring log_ring;
+//set once log records go through the writer thread
+int log_writer_running = 0;
+unsigned long long log_dropped_count = 0;
 
 // 0 = ERROR
 // 1 = WARNING
 // 2 = INFO
 // 3 = DEBUG
 int debug_level = 1;
-struct client *client_head = NULL;
-struct subscription *subscription_head = NULL;
-struct channel *channel_head = NULL;
+//log timestamp, formatted at most once per second
+__thread time_t log_second = 0;
+__thread char log_timestamp[24];
+__thread struct client *client_head = NULL;
+//clients, subscriptions and channels are allocated from these
+__thread struct pool pools[POOL_COUNT] = {
+    POOL_INITIALIZER (struct client),
+    POOL_INITIALIZER (struct subscription),
+    POOL_INITIALIZER (struct channel)
+};
+//clients to shut down once the current batch of events is handled
+__thread struct client *close_head = NULL;
+//set while events are handled, output is then queued and written in one
+//go per client by flush_pending_clients
+__thread int batching = 0;
+__thread struct client *flush_head = NULL;
+
+//channels indexed by name, chained per bucket
+__thread struct channel **channel_table = NULL;
+__thread u_int channel_table_size = 0;
+//channels without subscribers kept for their history, least recently
+//announced to first
+__thread struct channel *idle_head = NULL;
+__thread struct channel *idle_tail = NULL;
+
+//pattern subscriptions, literal trie nodes indexed by parent and segment
+__thread struct pattern_node pattern_root;
+__thread struct pattern_node **pattern_table = NULL;
+__thread u_int pattern_table_size = 0;
+__thread u_int pattern_node_count = 0;
+//bumped for every walk over the pattern trie
+__thread unsigned long long pattern_walk = 0;
+//bumped for every announcement delivered on this shard
+__thread unsigned long long announce_epoch = 0;
+//set for the event loop passes being traced
+__thread int trace_active = 0;
+__thread unsigned long long trace_passes = 0;
+__thread struct trace_frame trace_stack[TRACE_DEPTH];
+__thread int trace_depth = 0;
+//submission and completion queues with --io-backend=io_uring
+__thread struct uring ring;
+//every pass frees and takes most of them again, so they are kept instead
+//of going back to the allocator
+__thread struct uring_send *uring_send_free = NULL;
+//shards holding pattern subscriptions, they see every announcement
+uint64_t pattern_shards = 0;
 
 struct rlimit s_rlimit;
 
@@ -152,15 +1152,11 @@ int main (int argc, char *argv[])
     hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
     hints.ai_socktype = SOCK_STREAM;
     int e;
-    int epollfd, efd, res;
+    int policy;
+    int mode;
     int portno = 1986;
-    int optval;
-    socklen_t optlen = sizeof(optval);
-    u_int listen_backlog = 25;
-    u_int max_events = 25;
     char *pidfilename = NULL;
     server_start_time = (long)time (NULL);
-    char buffer[1025];
 
     struct passwd *pwd;
     struct group *grp;
@@ -170,19 +1166,6 @@ int main (int argc, char *argv[])
     uid_t user_id = -1;
     gid_t group_id = -1;
 
-    struct epoll_event ev, events[max_events];
-
-    struct client *client_i = NULL;
-    
-    struct linger so_linger;
-    so_linger.l_onoff = 1;
-    // immediately discard any remaining data
-    so_linger.l_linger = 0;
-
-
-    socklen_t clilen;
-    struct sockaddr_storage cli_addr;
-
     static struct option long_options[] = {
         {"port", 1, 0, 0},
         {"daemon", 0, &daemonize, 1},
@@ -193,6 +1176,22 @@ int main (int argc, char *argv[])
         {"client-limit", 1, 0, 0},
         {"run-as", 1, 0, 0},
         {"max-logfile-size", 1, 0, 0},
+        {"max-output-buffer", 1, 0, 0},
+        {"slow-consumer-policy", 1, 0, 0},
+        {"threads", 1, 0, 0},
+        {"max-events", 1, 0, 0},
+        {"max-logfiles", 1, 0, 0},
+        {"history-messages", 1, 0, 0},
+        {"history-bytes", 1, 0, 0},
+        {"journal", 1, 0, 0},
+        {"journal-segment-size", 1, 0, 0},
+        {"durable-prefix", 1, 0, 0},
+        {"listen-backlog", 1, 0, 0},
+        {"listen-mode", 1, 0, 0},
+        {"metrics-port", 1, 0, 0},
+        {"trace-sample", 1, 0, 0},
+        {"io-backend", 1, 0, 0},
+        {"history-channels", 1, 0, 0},
         {NULL, 0, NULL, 0}
     };
 
@@ -212,6 +1211,13 @@ int main (int argc, char *argv[])
                         if ((logfile = fopen (optarg, "a")) == NULL) {
                             fanout_error ("ERROR cannot open logfile");
                         }
+                        //rotation renames the file after the chdir below
+                        if ((logfile_name = realpath (optarg, NULL)) == NULL) {
+                            fanout_error ("ERROR resolving logfile path");
+                        }
+                        struct stat logfile_stat;
+                        if (fstat (fileno (logfile), &logfile_stat) == 0)
+                            logfile_size = logfile_stat.st_size;
                         break;
                     // pidfile
                     case 3:
@@ -240,10 +1246,74 @@ restrictions\n");
 ing ulimit -n X\n");
                         printf("                           or sysctl -w \
 fs.file-max=100000\n");
+                        printf("  --threads=N              event loop threads, \
+1 (default)\n");
+                        printf("                           up to 64\n");
+                        printf("  --max-events=N           events handled per e\
+poll_wait\n");
+                        printf("                           25 (default)\n");
+                        printf("  --listen-backlog=N       pending connection q\
+ueue, %d (default)\n", SOMAXCONN);
+                        printf("  --listen-mode=MODE       how threads share ne\
+w connections\n");
+                        printf("                           reuseport (default)\
+\n");
+                        printf("                           exclusive\n");
+                        printf("  --metrics-port=PORT      serve Prometheus met\
+rics over HTTP\n");
+                        printf("                           0 = off (default)\n\
+");
+                        printf("  --trace-sample=N         time the stages of o\
+ne in N event loop\n");
+                        printf("                           passes, 64 (default)\
+, 0 = off\n");
+                        printf("  --io-backend=BACKEND     how event loops do s\
+ocket io\n");
+                        printf("                           epoll (default)\n");
+                        printf("                           io_uring\n");
+                        printf("  --max-output-buffer=SIZE queued output per cli\
+ent in bytes\n");
+                        printf("                           0 = unlimited (defau\
+lt)\n");
+                        printf("  --slow-consumer-policy=POLICY\n");
+                        printf("                           applied when max-out\
+put-buffer is hit\n");
+                        printf("                           disconnect (default)\
+\n");
+                        printf("                           drop-oldest\n");
+                        printf("                           drop-newest\n");
+                        printf("                           coalesce\n");
 
                         printf("  --logfile=PATH           path to log file\n");
                         printf("  --max-logfile-size=SIZE  logfile size in MB\n\
 ");
+                        printf("  --max-logfiles=N         rotated logfiles kep\
+t, 5 (default)\n");
+                        printf("                           0 = truncate instead\
+\n");
+                        printf("  --history-messages=N     messages kept per ch\
+annel for replay\n");
+                        printf("                           0 = off (default)\n");
+                        printf("  --history-bytes=SIZE     history cap per chan\
+nel in bytes\n");
+                        printf("                           0 = unlimited (defau\
+lt)\n");
+                        printf("  --history-channels=N     channels kept for th\
+eir history\n");
+                        printf("                           without subscribers,\
+ 65536 (default)\n");
+                        printf("                           0 = unlimited\n");
+                        printf("  --journal=DIR            journal durable chan\
+nels to DIR\n");
+                        printf("                           requires --history-m\
+essages\n");
+                        printf("  --journal-segment-size=SIZE\n");
+                        printf("                           journal segment size\
+ in MB, 64 (default)\n");
+                        printf("  --durable-prefix=PREFIX  journal only channel\
+s starting with PREFIX\n");
+                        printf("                           all channels (defaul\
+t)\n");
                         printf("  --pidfile=PATH           path to pid file\n");
                         printf("  --debug-level=LEVEL      verbosity level\n");
                         printf("                         \
@@ -302,87 +1372,259 @@ xit\n");
 
                         break;
 
-                }
-                break;
-            default:
-                exit (EXIT_FAILURE);
-        }
-    }
+                    //max-output-buffer
+                    case 9:
+                        if ( ! is_numeric (optarg)) {
+                            printf ("invalid max output buffer: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        max_output_buffer = strtoul (optarg, NULL, 10);
+                        break;
 
-    if (optind < argc) {
-        fanout_debug (0, "ERROR invalid args: ");
-        while (optind < argc)
-            printf ("%s ", argv[optind++]);
-        printf ("\n");
-        exit (EXIT_FAILURE);
-    }
+                    //slow-consumer-policy
+                    case 10:
+                        for (policy = POLICY_COALESCE; policy >= 0; policy--) {
+                            if ( ! strcmp (optarg,
+                                            slow_consumer_policy_names[policy]))
+                                break;
+                        }
+                        if (policy < 0) {
+                            printf ("invalid slow consumer policy: %s\n",
+                                     optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        slow_consumer_policy = policy;
+                        break;
 
-    if ( ! (portno > 0)) {
-        fanout_debug (0, "ERROR invalid port\n");
-        exit (EXIT_FAILURE);
-    }
+                    //threads
+                    case 11:
+                        shard_count = atoi (optarg);
 
-    char buf[6];
-    snprintf(buf, sizeof buf, "%d", portno);
+                        if (shard_count < 1 || shard_count > 64) {
+                            printf ("invalid thread count: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        break;
 
-    e = getaddrinfo (NULL, buf, &hints, &ai);
-    if (e != 0) {
-        fanout_error ("getaddrinfo");
-        exit (EXIT_FAILURE);
-    }
+                    //max-events
+                    case 12:
+                        if ( ! is_numeric (optarg) || atoi (optarg) < 1) {
+                            printf ("invalid max events: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        max_events = atoi (optarg);
+                        break;
 
-    int nfds = 0;
-    struct addrinfo *runp = ai;
-    while (runp != NULL) {
-        ++nfds;
-        runp = runp->ai_next;
-    }
-    struct epoll_event fds[nfds];
+                    //max-logfiles
+                    case 13:
+                        if ( ! is_numeric (optarg)) {
+                            printf ("invalid max logfiles: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        max_logfiles = atoi (optarg);
+                        break;
 
-    for (nfds = 0, runp = ai; runp != NULL; runp = runp->ai_next)  {
-        memset(&fds[nfds], 0, sizeof(struct epoll_event));
-        fds[nfds].data.fd = socket (runp->ai_family, runp->ai_socktype, runp->ai_protocol);
-        if (fds[nfds].data.fd == -1) {
-            fanout_error ("ERROR opening socket");
-            exit (EXIT_FAILURE);
-        }
-        fds[nfds].events = EPOLLIN;
+                    //history-messages
+                    case 14:
+                        if ( ! is_numeric (optarg)) {
+                            printf ("invalid history messages: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        history_messages = strtoul (optarg, NULL, 10);
+                        break;
 
-        optval = 1;
-        if (runp->ai_family==AF_INET6 && setsockopt (fds[nfds].data.fd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, optlen) == -1) {
-            fanout_error ("failed setting IPV6_V6ONLY");
-            exit (EXIT_FAILURE);
-        }
+                    //history-bytes
+                    case 15:
+                        if ( ! is_numeric (optarg)) {
+                            printf ("invalid history bytes: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        history_bytes = strtoul (optarg, NULL, 10);
+                        break;
 
-        optval = 1;
-        if (setsockopt (fds[nfds].data.fd, SOL_SOCKET, SO_REUSEADDR, &optval, optlen) == -1) {
-            fanout_error ("failed setting REUSEADDR");
-            exit (EXIT_FAILURE);
-        }
-        
-        if (bind (fds[nfds].data.fd, runp->ai_addr, runp->ai_addrlen ) != 0) {
-            fanout_error ("ERROR on binding");
-            exit (EXIT_FAILURE);
-        } else {
-            if (listen (fds[nfds].data.fd, listen_backlog) != 0) {
-                fanout_error ("ERROR listening on server socket");
+                    //journal
+                    case 16:
+                        //segments are created after the chdir below
+                        if ((journal.dir = realpath (optarg, NULL)) == NULL) {
+                            fanout_error ("ERROR resolving journal path");
+                        }
+                        break;
+
+                    //journal-segment-size
+                    case 17:
+                        if ( ! is_numeric (optarg) || atoi (optarg) < 1) {
+                            printf ("invalid journal segment size: %s\n",
+                                     optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        journal_segment_size = strtoul (optarg, NULL, 10)
+                                               * 1024 * 1024;
+                        break;
+
+                    //durable-prefix
+                    case 18:
+                        durable_prefix = optarg;
+                        durable_prefix_length = strlen (optarg);
+                        break;
+
+                    //listen-backlog
+                    case 19:
+                        if ( ! is_numeric (optarg) || atoi (optarg) < 1) {
+                            printf ("invalid listen backlog: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        listen_backlog = atoi (optarg);
+                        break;
+
+                    //listen-mode
+                    case 20:
+                        for (mode = LISTEN_EXCLUSIVE; mode >= 0; mode--) {
+                            if ( ! strcmp (optarg, listen_mode_names[mode]))
+                                break;
+                        }
+                        if (mode < 0) {
+                            printf ("invalid listen mode: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        listen_mode = mode;
+                        break;
+
+                    //metrics-port
+                    case 21:
+                        metrics_port = atoi (optarg);
+
+                        if ( ! is_numeric (optarg) || metrics_port > 65535) {
+                            printf ("invalid metrics port: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        break;
+
+                    //trace-sample
+                    case 22:
+                        if ( ! is_numeric (optarg)) {
+                            printf ("invalid trace sample: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        trace_sample = strtoul (optarg, NULL, 10);
+                        break;
+
+                    //io-backend
+                    case 23:
+                        for (mode = IO_BACKEND_URING; mode >= 0; mode--) {
+                            if ( ! strcmp (optarg, io_backend_names[mode]))
+                                break;
+                        }
+                        if (mode < 0) {
+                            printf ("invalid io backend: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        io_backend = mode;
+                        break;
+
+                    //history-channels
+                    case 24:
+                        if ( ! is_numeric (optarg)) {
+                            printf ("invalid history channels: %s\n", optarg);
+                            exit (EXIT_FAILURE);
+                        }
+                        history_channels = strtoul (optarg, NULL, 10);
+                        break;
+
+                }
+                break;
+            default:
                 exit (EXIT_FAILURE);
-            }
-            ++nfds;
         }
     }
-    freeaddrinfo(ai);
 
-    if((epollfd = epoll_create (nfds)) < 0)
-        fanout_error ("ERROR creating epoll instance");
+    if (optind < argc) {
+        fanout_debug (0, "ERROR invalid args: ");
+        while (optind < argc)
+            printf ("%s ", argv[optind++]);
+        printf ("\n");
+        exit (EXIT_FAILURE);
+    }
 
-    for (int n = 0; n < nfds; n++) {
-        if (epoll_ctl (epollfd, EPOLL_CTL_ADD, fds[n].data.fd, &fds[n]) == -1) {
-            fanout_error ("epoll_ctl: srvsock");
+    if ( ! (portno > 0)) {
+        fanout_debug (0, "ERROR invalid port\n");
+        exit (EXIT_FAILURE);
+    }
+
+    //a reconnecting client may land on any shard, which only holds the
+    //history of its own channels
+    if (history_messages > 0 && shard_count > 1) {
+        fanout_debug (0, "ERROR history requires --threads=1\n");
+        exit (EXIT_FAILURE);
+    }
+
+    //the journal restores and extends the history
+    if (journal.dir != NULL && history_messages == 0) {
+        fanout_debug (0, "ERROR journal requires --history-messages\n");
+        exit (EXIT_FAILURE);
+    }
+
+    //refused by the kernel or disabled by sysctl, better found out now
+    //than in the event loops
+    if (io_backend == IO_BACKEND_URING) {
+        struct io_uring_params params;
+        int fd;
+
+        memset (&params, 0, sizeof (params));
+        if ((fd = uring_setup (1, &params)) == -1) {
+            fanout_debug (0, "ERROR io_uring unavailable: %s\n",
+                           strerror (errno));
             exit (EXIT_FAILURE);
         }
+        close (fd);
     }
 
+    //room for any int, the metrics port is formatted into it too
+    char buf[12];
+    snprintf(buf, sizeof buf, "%d", portno);
+
+    e = getaddrinfo (NULL, buf, &hints, &ai);
+    if (e != 0) {
+        fanout_error ("getaddrinfo");
+        exit (EXIT_FAILURE);
+    }
+
+    if ((shards = calloc (shard_count, sizeof (struct shard))) == NULL) {
+        fanout_error ("memory error");
+    }
+
+    for (u_int i = 0; i < INTEREST_STRIPES; i++) {
+        pthread_mutex_init (&interest_stripes[i].lock, NULL);
+    }
+
+    //every shard binds its own listeners, the kernel spreads connections
+    //across them with SO_REUSEPORT, or all shards watch the first shard's
+    for (u_int i = 0; i < shard_count; i++) {
+        shard_init (&shards[i], i);
+        if (i == 0 || listen_mode == LISTEN_REUSEPORT) {
+            shard_listen (&shards[i], ai, listen_backlog);
+        } else {
+            shards[i].listeners = shards[0].listeners;
+            shards[i].listener_count = shards[0].listener_count;
+        }
+        //io_uring event loops accept on their ring instead
+        if (io_backend == IO_BACKEND_EPOLL)
+            shard_watch_listeners (&shards[i]);
+    }
+    freeaddrinfo(ai);
+
+    //scrapes are answered by the first event loop
+    if (metrics_port > 0) {
+        snprintf (buf, sizeof buf, "%d", metrics_port);
+        if (getaddrinfo (NULL, buf, &hints, &ai) != 0)
+            fanout_error ("getaddrinfo");
+        metrics_listen (ai);
+        freeaddrinfo (ai);
+    }
+
+    //blocked before any thread starts so that only the first event loop
+    //sees it
+    trace_signal_init ();
+
 
     if (daemonize) {
         pid_t pid, sid;
@@ -433,19 +1675,39 @@ xit\n");
 
     getrlimit (RLIMIT_NOFILE,&s_rlimit);
 
-    // epollfd, srvsock, extra for reporting busy
-    base_fds = 3;
+    // epollfd, eventfd, srvsocks and a reserve per shard, extra for
+    // reporting busy
+    base_fds = shard_count * (3 + shards[0].listener_count) + 1;
 
     //additional padding for safety
     base_fds += 10;
 
+    //SIGUSR1 signalfd
+    base_fds += 1;
+
+    //a ring per shard
+    if (io_backend == IO_BACKEND_URING) {
+        base_fds += shard_count;
+    }
+
+    //metrics listeners, their timer and the scrapes in flight
+    if (metrics_port > 0) {
+        base_fds += metrics_listener_count + 1 + METRICS_MAX_CLIENTS;
+    }
+
     //stdin/out/err
     if ( ! daemonize) {
         base_fds += 3;
     }
 
+    //logfile and the writer's eventfd
     if (logfile) {
-        base_fds++;
+        base_fds += 2;
+    }
+
+    //open journal segment and one being recovered
+    if (journal.dir != NULL) {
+        base_fds += 2;
     }
 
     fd_limit = s_rlimit.rlim_cur;
@@ -498,161 +1760,25 @@ xit\n");
     fanout_debug (2, "base fds: %d\n", base_fds);
     fanout_debug (2, "max client connections: %d\n", client_limit);
 
-    while (1) {
-        int nevents;
-
-        fanout_debug (3, "server waiting for new activity\n");
+    //from here on the event loops hand log records to a writer thread
+    if (logfile != NULL)
+        log_writer_start ();
 
-        errno = 0;
-        if ((nevents = epoll_wait (epollfd, events, max_events, -1)) == -1) {
-            if (errno == EINTR) {
-                continue;
-            }
-            fanout_error ("epoll_wait");
-        }
+    //durable channels are restored before clients can subscribe, the main
+    //thread runs the only event loop and so owns the restored channels
+    if (journal.dir != NULL)
+        journal_open ();
 
-        if (nevents == 0) {
-            continue;
+    for (u_int i = 1; i < shard_count; i++) {
+        if (pthread_create (&shards[i].thread, NULL, shard_run,
+                             &shards[i]) != 0) {
+            fanout_error ("ERROR starting event loop thread");
         }
-
-        for (int n = 0; n < nevents; n++) {
-            // new connection
-            efd = events[n].data.fd;
-            fanout_debug (3, "processing event %d of %d\n", (n+1),
-                           nevents);
-            fanout_debug (3, "current event fd %d\n", efd);
-
-            int newconnection = 0;
-            for (int m = 0; m < nfds; m++) {
-                if (efd == fds[m].data.fd) {
-                    newconnection = 1;
-                    break;
-                }
-            }
-            if (newconnection) {
-                if ((client_i = calloc (1, sizeof (struct client))) == NULL) {
-                    fanout_debug (0, "memory error\n");
-                    continue;
-                }
-
-                clilen = sizeof (cli_addr);
-                if ((client_i->fd = accept (efd,
-                                             (struct sockaddr *)&cli_addr,
-                                             &clilen)) == -1) {
-                    fanout_debug (0, "%s\n", strerror (errno));
-                    free (client_i);
-                    fanout_error ("failed on accept ()");
-                    continue;
-                }
-
-                int current_count = client_count ();
-
-                if (client_limit > 0 && current_count >= client_limit) {
-                    fanout_debug (1, "hit connection limit of: %d\n",
-                                   client_limit);
-
-                    errno = 0;
-                    ssize_t sentout = send (client_i->fd, "debug!busy\n",
-                           strlen ("debug!busy\n"), 0);
-
-                    if ((sentout == -1) && errno) {
-                        fanout_debug (0, "%s\n", strerror (errno));
-                    }
-
-                    close (client_i->fd);
-                    free (client_i);
-                    if (client_limit_count == ULLONG_MAX) {
-                        fanout_debug (1, "wow, you've limited alot..\
-resetting counter\n");
-                        client_limit_count = 0;
-                    }
-                    client_limit_count++;
-                    continue;
-                }
-
-                //add new socket to watch list
-                ev.events = EPOLLIN;
-                ev.data.fd = client_i->fd;
-                if (epoll_ctl (epollfd, EPOLL_CTL_ADD,
-                     client_i->fd, &ev) == -1) {
-                    fanout_error ("epoll_ctl: srvsock");
-                }
-
-                optval = 1;
-                if ((setsockopt (client_i->fd, SOL_SOCKET, SO_KEEPALIVE,
-                      &optval, optlen)) == -1)
-                    fanout_error ("failed setting keepalive");
-
-                if ((setsockopt (client_i->fd, SOL_SOCKET, SO_LINGER,
-                      &so_linger, sizeof so_linger)) == -1)
-                    fanout_error ("failed setting linger");
-
-                //Shove current new connection in the front of the line
-                client_i->next = client_head;
-                if (client_head != NULL) {
-                    client_head->previous = client_i;
-                }
-                client_head = client_i;
-
-                current_count ++;
-                if (current_count > max_client_count) {
-                    max_client_count = current_count;
-                }
-
-                //char *peer = getsocketpeername (client_i->fd);
-                //fanout_debug (2, "client socket %d connected from %s\n",
-                fanout_debug (2, "client socket %d connected\n",
-                               client_i->fd);
-                client_write (client_i, "debug!connected...\n");
-                subscribe (client_i, "all");
-
-                //stats
-                if (clients_count == ULLONG_MAX) {
-                    fanout_debug (1, "wow, you've accepted alot of connections.\
-.resetting counter\n");
-                    clients_count = 0;
-                }
-                clients_count++;
-
-            } else {
-                //should be an existing client connection
-                if ((client_i = get_client (efd)) != NULL) {
-                        // Process data from socket i
-                        fanout_debug (3, "processing client %d\n",
-                                       client_i->fd);
-                        memset (buffer, 0, sizeof (buffer));
-                        res = recv (client_i->fd, buffer, 1024, 0);
-                        buffer[1024] = '\0';
-                        if (res <= 0) {
-                            fanout_debug (2, "client socket disconnected\n");
-
-                            //del socket from watch list
-                            if (epoll_ctl (epollfd, EPOLL_CTL_DEL,
-                                 client_i->fd, &ev) == -1) {
-                                fanout_error ("epoll_ctl: srvsock");
-                            }
-                            fanout_debug (3, "client socket removed from epoll watch list\n");
-                            shutdown_client (client_i);
-                        } else {
-                            // Process data in buffer
-                            fanout_debug (3, "%d bytes read: [%.*s]\n", res,
-                                          (res - 1), buffer);
-                            client_i->input_buffer = str_append (
-                                                        client_i->input_buffer,
-                                                        buffer);
-                            client_process_input_buffer (client_i);
-                        }
-
-                }
-                break;
-            }//end else
-        }//end for
-    }//end while (1)
-
-    for (int n = 0; n < nfds; n++) {
-        close (fds[n].data.fd);
     }
-    return 0; 
+
+    //the main thread runs the first shard
+    shard_run (&shards[0]);
+    return 0;
 }
 
 
@@ -667,31 +1793,6 @@ int is_numeric (char *str)
 }
 
 
-int strcpos (const char *haystack, const char c)
-{
-    for (int i = 0; i <= strlen (haystack); i++) {
-        if (haystack[i] == c)
-            return i;
-    }
-    return -1;
-}
-
-
-char *substr (const char *s, int start, int stop)
-{
-    char *v;
-    asprintf(&v, "%.*s", stop - start + 1, &s[start]);
-    return v;
-}
-
-
-void str_swap_free (char **target, char *source)
-{
-    free (*target);
-    *target = source;
-}
-
-
 char *str_append (char *target, const char *data)
 {
     char *newtarget;
@@ -734,6 +1835,112 @@ void clear_socket_buffer (int sock)
 }
 
 
+struct message *message_create (size_t length)
+{
+    struct message *m;
+
+    if ((m = malloc (sizeof (struct message) + length + 1)) == NULL) {
+        fanout_error ("ERROR unable to allocate memory");
+    }
+    m->refcount = 1;
+    m->length = length;
+    m->channel_length = 0;
+    m->channel_offset = 0;
+    m->seq = 0;
+    m->binary_only = 0;
+    m->data[length] = '\0';
+    return m;
+}
+
+
+struct message *message_from_string (const char *data)
+{
+    size_t length = strlen (data);
+    struct message *m = message_create (length);
+
+    memcpy (m->data, data, length);
+    return m;
+}
+
+
+struct message *frame_create (enum frame_opcode opcode,
+                              unsigned long long seq, const char *channel,
+                              size_t channel_length, const char *payload,
+                              size_t payload_length)
+{
+    size_t header_length = FRAME_HEADER_LENGTH + (seq ? 8 : 0);
+    struct message *m = message_create (header_length + channel_length
+                                        + payload_length);
+    u_char *header = (u_char *) m->data;
+
+    header[0] = opcode;
+    header[1] = seq ? FRAME_FLAG_SEQ : 0;
+    header[2] = channel_length >> 8;
+    header[3] = channel_length;
+    header[4] = payload_length >> 24;
+    header[5] = payload_length >> 16;
+    header[6] = payload_length >> 8;
+    header[7] = payload_length;
+    for (int i = 0; i < (seq ? 8 : 0); i++)
+        header[FRAME_HEADER_LENGTH + i] = seq >> (56 - 8 * i);
+    memcpy (m->data + header_length, channel, channel_length);
+    memcpy (m->data + header_length + channel_length, payload,
+            payload_length);
+    m->channel_length = channel_length;
+    m->channel_offset = header_length;
+    m->seq = seq;
+    return m;
+}
+
+
+//the binary frame of a channel!message\n announcement
+struct message *message_frame (struct message *m)
+{
+    return frame_create (FRAME_MESSAGE, m->seq, m->data, m->channel_length,
+                         m->data + m->channel_length + 1,
+                         m->length - m->channel_length - 2);
+}
+
+
+//whether a text subscriber can tell the channel from the message and the
+//message from the next one, the same rules the text parser applies
+int message_is_text (const char *channel, size_t channel_length,
+                     const char *message, size_t message_length)
+{
+    for (size_t i = 0; i < channel_length; i++) {
+        if (channel[i] == '!' || channel[i] == ' ' || channel[i] == '\n'
+            || channel[i] == '\0')
+            return 0;
+    }
+    return memchr (message, '\n', message_length) == NULL;
+}
+
+
+void message_retain (struct message *m)
+{
+    //messages are only shared between shards when there is more than one
+    if (shard_count == 1)
+        m->refcount++;
+    else
+        __atomic_add_fetch (&m->refcount, 1, __ATOMIC_RELAXED);
+}
+
+
+void message_release (struct message *m)
+{
+    u_int refcount;
+
+    if (shard_count == 1)
+        refcount = --m->refcount;
+    else
+        refcount = __atomic_sub_fetch (&m->refcount, 1, __ATOMIC_ACQ_REL);
+
+    if (refcount == 0)
+        free (m);
+}
+
+
+
 void fanout_error(const char *msg)
 {
     fanout_debug (0, "%s: %s\n", msg, strerror (errno));
@@ -741,9 +1948,14 @@ void fanout_error(const char *msg)
 }
 
 
-void fanout_debug (int level, const char *format, ...)
+void fanout_log (int level, const char *format, ...)
 {
     char *s_level;
+    struct timespec now;
+    char buffer[1024];
+    char *message = buffer;
+    int length;
+    va_list args;
 
     switch (level) {
         case 0:
@@ -760,353 +1972,4253 @@ void fanout_debug (int level, const char *format, ...)
             break;
     }
 
-    char *message;
-    asprintf(&message, "[%d] %s: ", (u_int) time(NULL), s_level);
-    char *data;
-    va_list args;
+    clock_gettime (CLOCK_REALTIME_COARSE, &now);
+    if (now.tv_sec != log_second) {
+        log_second = now.tv_sec;
+        snprintf (log_timestamp, sizeof (log_timestamp), "[%d]",
+                  (u_int) now.tv_sec);
+    }
+
+    int prefix = snprintf (buffer, sizeof (buffer), "%s %s: ", log_timestamp,
+                           s_level);
     va_start(args, format);
-    vasprintf (&data, format, args);
+    length = vsnprintf (buffer + prefix, sizeof (buffer) - prefix, format,
+                        args);
     va_end(args);
 
-    message = str_append (message, data);
-
-    if (debug_level >= level) {
-        if ( ! daemonize)
-            printf ("%s", message);
-
-        if (logfile != NULL) {
-            if (max_logfile_size > 0) {
-                long current_pos;
-                long filesize;
-                if ((current_pos = ftell (logfile)) == -1)
-                    exit (EXIT_FAILURE);
-                //MB
-                filesize = (current_pos / 1024 / 1024);
-                if (filesize >= max_logfile_size) {
-                    if ((ftruncate(fileno (logfile), (off_t) 0)) == -1)
-                        exit (EXIT_FAILURE);
-                }
-            }
-            fprintf (logfile, "%s", message);
+    if (length < 0)
+        return;
+
+    //only long lines go to the heap
+    if (length >= sizeof (buffer) - prefix) {
+        if ((message = malloc (prefix + length + 1)) == NULL)
+            return;
+        memcpy (message, buffer, prefix);
+        va_start(args, format);
+        vsnprintf (message + prefix, length + 1, format, args);
+        va_end(args);
+    }
+
+    if ( ! daemonize)
+        fputs (message, stdout);
+
+    if (logfile != NULL) {
+        if ( ! log_writer_running) {
+            log_write (message, strlen (message));
             fflush (logfile);
+        } else {
+            char *record = (message != buffer) ? message : strdup (message);
+            message = buffer;
+
+            if (record == NULL || ! log_push (record)) {
+                free (record);
+                __atomic_add_fetch (&log_dropped_count, 1, __ATOMIC_RELAXED);
+            } else if ( ! __atomic_exchange_n (&log_ring.signalled, 1,
+                                                __ATOMIC_SEQ_CST)) {
+                uint64_t value = 1;
+                //a failed wakeup can't be logged, the next record retries
+                if (write (log_ring.fd, &value, sizeof (value)) == -1)
+                    __atomic_store_n (&log_ring.signalled, 0,
+                                      __ATOMIC_RELAXED);
+            }
         }
     }
 
-    free (data);
-    free (message);
+    if (message != buffer)
+        free (message);
 }
 
-char *getsocketpeername (int fd)
+
+//append a record to the logfile, rotating it once it reaches
+//max-logfile-size, only one thread at a time writes records
+void log_write (const char *record, size_t length)
 {
-    struct sockaddr_storage m_addr;
-    socklen_t len;
-    len = sizeof m_addr;
+    if (logfile == NULL)
+        return;
 
-    getpeername (fd, (struct sockaddr*)&m_addr, &len);
-    getnameinfo ((struct sockaddr*)&m_addr, len, ipstr, sizeof ipstr, NULL, 0, NI_NUMERICHOST);
-    return ipstr;
+    if (max_logfile_size > 0
+         && logfile_size / 1024 / 1024 >= max_logfile_size)
+        log_rotate ();
+
+    if (logfile != NULL && fwrite (record, 1, length, logfile) == length)
+        logfile_size += length;
 }
 
 
-int channel_exists (const char *channel_name)
+void log_rotate ()
 {
-    struct channel *channel_i = channel_head;
-    while (channel_i != NULL) {
-        if ( ! strcmp (channel_name, channel_i->name))
-            return 1;
-        channel_i = channel_i->next;
+    char *from;
+    char *to;
+
+    fflush (logfile);
+
+    //keep the old behaviour of starting over in the same file
+    if (max_logfiles < 1) {
+        if (ftruncate (fileno (logfile), (off_t) 0) == -1)
+            exit (EXIT_FAILURE);
+        logfile_size = 0;
+        return;
     }
-    return 0;
-}
 
+    fclose (logfile);
 
-int channel_has_subscription (struct channel *c)
-{
-    if (c->subscription_count > 0) {
-        return 1;
+    //fanout.log.1 becomes fanout.log.2 and so on, the oldest is overwritten
+    for (int i = max_logfiles - 1; i > 0; i--) {
+        asprintf (&from, "%s.%d", logfile_name, i);
+        asprintf (&to, "%s.%d", logfile_name, i + 1);
+        rename (from, to);
+        free (from);
+        free (to);
     }
-    return 0;
+    asprintf (&to, "%s.1", logfile_name);
+    rename (logfile_name, to);
+    free (to);
+
+    //losing the logfile stops file logging rather than the service
+    logfile = fopen (logfile_name, "a");
+    logfile_size = 0;
 }
 
 
-struct channel *get_channel (const char *channel_name)
+int log_push (char *record)
 {
-    struct channel *channel_i = channel_head;
-
-    while (channel_i != NULL) {
-        if ( ! strcmp (channel_name, channel_i->name))
-            return channel_i;
-        channel_i = channel_i->next;
-    }
+    size_t position = __atomic_load_n (&log_ring.head, __ATOMIC_RELAXED);
+    struct log_slot *slot;
 
-    fanout_debug (2, "creating new channel %s\n", channel_name);
-    if ((channel_i = calloc (1, sizeof (struct channel))) == NULL) {
-        fanout_error ("memory error");
+    while (1) {
+        slot = &log_ring.slots[position & (LOG_RING_SIZE - 1)];
+        size_t sequence = __atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE);
+        long difference = (long) sequence - (long) position;
+
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n (&log_ring.head, &position,
+                                             position + 1, 1, __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED))
+                break;
+        } else if (difference < 0) {
+            //full, the writer is behind
+            return 0;
+        } else {
+            position = __atomic_load_n (&log_ring.head, __ATOMIC_RELAXED);
+        }
     }
 
-    asprintf (&channel_i->name, "%s", channel_name);
-    channel_i->next = channel_head;
-    if (channel_head != NULL)
-        channel_head->previous = channel_i;
-    channel_head = channel_i;
-    return channel_i;
+    slot->record = record;
+    __atomic_store_n (&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    return 1;
 }
 
 
-void remove_channel (struct channel *c)
+char *log_pop ()
 {
-    fanout_debug (2, "removing unused channel %s\n", c->name);
+    struct log_slot *slot = &log_ring.slots[log_ring.tail
+                                            & (LOG_RING_SIZE - 1)];
+    char *record;
+
+    if (__atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE)
+         != log_ring.tail + 1)
+        return NULL;
+
+    record = slot->record;
+    __atomic_store_n (&slot->sequence, log_ring.tail + LOG_RING_SIZE,
+                      __ATOMIC_RELEASE);
+    log_ring.tail++;
+    return record;
+}
+
+
+void log_writer_start ()
+{
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        log_ring.slots[i].sequence = i;
+    log_ring.head = 0;
+    log_ring.tail = 0;
+
+    if ((log_ring.fd = eventfd (0, EFD_CLOEXEC)) == -1) {
+        fanout_error ("ERROR creating eventfd");
+    }
+    if (pthread_create (&log_ring.thread, NULL, log_writer_run, NULL) != 0) {
+        fanout_error ("ERROR starting log writer thread");
+    }
+    log_writer_running = 1;
+
+    //records queued before an exit still reach the logfile
+    atexit (log_writer_stop);
+}
+
+
+void *log_writer_run (void *arg)
+{
+    uint64_t value;
+    char *record;
+
+    while (1) {
+        if (read (log_ring.fd, &value, sizeof (value)) == -1
+             && errno != EINTR)
+            break;
+        //cleared before draining so that later records signal again
+        __atomic_exchange_n (&log_ring.signalled, 0, __ATOMIC_SEQ_CST);
+
+        //write the whole batch, then flush once
+        while ((record = log_pop ()) != NULL) {
+            log_write (record, strlen (record));
+            free (record);
+        }
+        if (logfile != NULL)
+            fflush (logfile);
+
+        if (__atomic_load_n (&log_ring.stopping, __ATOMIC_ACQUIRE))
+            break;
+    }
+    return NULL;
+}
+
+
+void log_writer_stop ()
+{
+    uint64_t value = 1;
+
+    if ( ! log_writer_running
+          || pthread_equal (pthread_self (), log_ring.thread))
+        return;
+
+    __atomic_store_n (&log_ring.stopping, 1, __ATOMIC_RELEASE);
+    if (write (log_ring.fd, &value, sizeof (value)) != -1)
+        pthread_join (log_ring.thread, NULL);
+}
+
+char *getsocketpeername (int fd)
+{
+    struct sockaddr_storage m_addr;
+    socklen_t len;
+    len = sizeof m_addr;
+
+    getpeername (fd, (struct sockaddr*)&m_addr, &len);
+    getnameinfo ((struct sockaddr*)&m_addr, len, ipstr, sizeof ipstr, NULL, 0, NI_NUMERICHOST);
+    return ipstr;
+}
+
+
+void *shard_run (void *arg)
+{
+    struct shard *s = arg;
+    struct epoll_event events[max_events];
+
+    current_shard = s;
+    epollfd = s->epollfd;
+    s->stats = &stats;
+    s->pools = pools;
+
+    fanout_debug (2, "event loop %d started\n", s->id);
+    if ((reserve_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC)) == -1)
+        fanout_error ("ERROR opening reserve descriptor");
+
+    if (io_backend == IO_BACKEND_URING)
+        return uring_run (s);
+
+    while (1) {
+        int nevents;
+
+        fanout_debug (3, "server waiting for new activity\n");
+
+        errno = 0;
+        if ((nevents = epoll_wait (epollfd, events, max_events, -1)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fanout_error ("epoll_wait");
+        }
+
+        if (nevents == 0) {
+            continue;
+        }
+        uint64_t loop_start = shard_pass_start (nevents);
+
+        for (int n = 0; n < nevents; n++) {
+            fanout_debug (3, "processing event %d of %d\n", (n+1),
+                           nevents);
+            shard_dispatch (s, &events[n]);
+        }
+
+        shard_pass_end (loop_start);
+    }//end while (1)
+
+    return NULL;
+}
+
+
+//start handling a batch of events, output is queued until shard_pass_end
+uint64_t shard_pass_start (int nevents)
+{
+    uint64_t loop_start = monotonic_ns ();
+    //every trace_sample-th pass is timed stage by stage
+    trace_active = trace_sample > 0
+                   && ++trace_passes % trace_sample == 0;
+
+    //event loop stats
+    if (stats.event_waits_count == ULLONG_MAX) {
+        fanout_debug (1, "wow, you've waited alot..resetting counter\n");
+        stats.event_waits_count = 0;
+    }
+    stats.event_waits_count++;
+    if (stats.events_count > ULLONG_MAX - nevents) {
+        fanout_debug (1, "wow, you've handled alot of events..\
+resetting counter\n");
+        stats.events_count = 0;
+    }
+    stats.events_count += nevents;
+
+    //interest entries retired from here on are not freed before this pass
+    //ends
+    if (shard_count > 1) {
+        __atomic_store_n (&current_shard->interest_epoch,
+                          __atomic_load_n (&interest_epoch, __ATOMIC_SEQ_CST),
+                          __ATOMIC_SEQ_CST);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    }
+
+    batching = 1;
+    return loop_start;
+}
+
+
+void shard_dispatch (struct shard *s, struct epoll_event *event)
+{
+    enum fd_type *event_type = event->data.ptr;
+    struct client *client_i = NULL;
+
+    //announcements routed from other shards
+    if (*event_type == FD_TYPE_INBOX) {
+        trace_begin (TRACE_INBOX);
+        shard_process_inbox (s);
+        trace_end ();
+        return;
+    }
+
+    if (*event_type == FD_TYPE_SIGNAL) {
+        trace_signal_read ();
+        return;
+    }
+
+    //metrics scrapes, only watched by the first shard
+    if (*event_type == FD_TYPE_METRICS_LISTENER) {
+        metrics_accept (event->data.ptr);
+        return;
+    }
+    if (*event_type == FD_TYPE_METRICS) {
+        struct metrics_client *mc = event->data.ptr;
+        if (event->events & EPOLLOUT)
+            metrics_write (mc);
+        else
+            metrics_read (mc);
+        return;
+    }
+    if (*event_type == FD_TYPE_METRICS_TIMER) {
+        metrics_expire ();
+        return;
+    }
+
+    // new connections
+    if (*event_type == FD_TYPE_LISTENER) {
+        trace_begin (TRACE_ACCEPT);
+        accept_clients (event->data.ptr);
+        trace_end ();
+        return;
+    }
+
+    //should be an existing client connection
+    client_i = event->data.ptr;
+    fanout_debug (3, "current event fd %d\n", client_i->fd);
+
+    if (client_i->closing) {
+        fanout_debug (3, "client %d is being disconnected\n",
+                       client_i->fd);
+        return;
+    }
+
+    //socket accepts more output, held for the end of the batch while it
+    //has journal records to commit so they are synced once
+    if (event->events & EPOLLOUT) {
+        if (journal.synced != journal.tail) {
+            client_flush_later (client_i);
+        } else {
+            trace_begin (TRACE_FLUSH);
+            client_flush (client_i);
+            trace_end ();
+        }
+    }
+
+    if ( ! (event->events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+
+    // Process data from socket i
+    fanout_debug (3, "processing client %d\n", client_i->fd);
+    int eof = 0;
+    trace_begin (TRACE_READ);
+    ssize_t res = client_read (client_i, &eof);
+    trace_end ();
+    fanout_probe2 (client_read, client_i->fd, res);
+    if (res > 0) {
+        fanout_debug (3, "%d bytes read from client %d\n",
+                       (int) res, client_i->fd);
+        trace_begin (TRACE_PARSE);
+        client_process_input_buffer (client_i);
+        trace_end ();
+    } else if ( ! eof) {
+        fanout_debug (3, "nothing to read from client %d\n",
+                       client_i->fd);
+    }
+
+    if (eof) {
+        //lines received before the disconnect are handled above
+        fanout_debug (2, "client socket disconnected\n");
+        client_close_later (client_i);
+    }
+}
+
+
+//write out and close what the batch of events left behind
+void shard_pass_end (uint64_t loop_start)
+{
+    batching = 0;
+    //one sync for the whole batch, before subscribers are sent any of it
+    trace_begin (TRACE_JOURNAL);
+    if (journal.dir != NULL)
+        journal_commit ();
+    trace_end ();
+    trace_begin (TRACE_FLUSH);
+    flush_pending_clients ();
+    trace_end ();
+    trace_begin (TRACE_CLOSE);
+    close_pending_clients ();
+    trace_end ();
+    trace_active = 0;
+
+    if (shard_count > 1)
+        interest_reclaim ();
+
+    histogram_observe (&stats.loop_histogram, HISTOGRAM_TIME_FIRST,
+                       monotonic_ns () - loop_start);
+}
+
+
+//take every pending connection, a burst of reconnects is drained in one
+//wakeup instead of one connection per epoll_wait
+void accept_clients (struct listener *listener)
+{
+    time_t now = time (NULL);
+
+    fanout_debug (3, "current event fd %d\n", listener->fd);
+
+    while (1) {
+        int fd;
+
+        //keepalive and linger are inherited from the listener
+        if ((fd = accept4 (listener->fd, NULL, NULL,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            //out of descriptors or memory, the pending connections are
+            //refused while descriptors are short
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS
+                 || errno == ENOMEM) {
+                if (accept_failed (listener, errno))
+                    continue;
+                break;
+            }
+            fanout_debug (0, "%s\n", strerror (errno));
+            fanout_error ("failed on accept ()");
+        }
+
+        add_client (fd, now);
+    }
+}
+
+
+//set up a newly accepted connection
+void add_client (int fd, time_t now)
+{
+    struct epoll_event ev;
+    struct client *client_i;
+    u_int count = __atomic_add_fetch (&current_client_count, 1,
+                                       __ATOMIC_RELAXED);
+
+    if (client_limit > 0 && count > client_limit) {
+        fanout_debug (1, "hit connection limit of: %d\n",
+                       client_limit);
+        refuse_client (fd);
+        __atomic_sub_fetch (&current_client_count, 1,
+                            __ATOMIC_RELAXED);
+        return;
+    }
+
+    if ((client_i = pool_alloc (&pools[POOL_CLIENT])) == NULL) {
+        fanout_debug (0, "memory error\n");
+        close (fd);
+        __atomic_sub_fetch (&current_client_count, 1,
+                            __ATOMIC_RELAXED);
+        return;
+    }
+    client_i->type = FD_TYPE_CLIENT;
+    client_i->fd = fd;
+
+    //add new socket to watch list, or start receiving on the ring
+    if (io_backend == IO_BACKEND_URING) {
+        uring_recv (client_i);
+    } else {
+        ev.events = EPOLLIN;
+        ev.data.ptr = client_i;
+        if (epoll_ctl (epollfd, EPOLL_CTL_ADD,
+             client_i->fd, &ev) == -1) {
+            fanout_error ("epoll_ctl: srvsock");
+        }
+    }
+
+    //Shove current new connection in the front of the line
+    client_i->next = client_head;
+    if (client_head != NULL) {
+        client_head->previous = client_i;
+    }
+    client_head = client_i;
+
+    u_int max = __atomic_load_n (&max_client_count,
+                                 __ATOMIC_RELAXED);
+    while (count > max
+            && ! __atomic_compare_exchange_n (&max_client_count,
+                                               &max, count, 0,
+                                               __ATOMIC_RELAXED,
+                                               __ATOMIC_RELAXED));
+
+    fanout_debug (2, "client socket %d connected\n",
+                   client_i->fd);
+    client_write (client_i, "debug!connected...\n");
+    subscribe (client_i, "all", 3);
+
+    //stats
+    if (stats.clients_count == ULLONG_MAX) {
+        fanout_debug (1, "wow, you've accepted alot of connections.\
+.resetting counter\n");
+        stats.clients_count = 0;
+    }
+    stats.clients_count++;
+
+    if (now != stats.accept_second) {
+        stats.accepts_last_second = now == stats.accept_second + 1
+                                    ? stats.accept_second_count : 0;
+        stats.accept_second = now;
+        stats.accept_second_count = 0;
+    }
+    if (++stats.accept_second_count > stats.max_accepts_per_second)
+        stats.max_accepts_per_second = stats.accept_second_count;
+}
+
+
+void refuse_client (int fd)
+{
+    errno = 0;
+    ssize_t sentout = send (fd, "debug!busy\n",
+           strlen ("debug!busy\n"), 0);
+
+    if ((sentout == -1) && errno) {
+        fanout_debug (0, "%s\n", strerror (errno));
+    }
+
+    close (fd);
+    if (stats.client_limit_count == ULLONG_MAX) {
+        fanout_debug (1, "wow, you've limited alot..\
+resetting counter\n");
+        stats.client_limit_count = 0;
+    }
+    stats.client_limit_count++;
+}
+
+
+//logged at most once a second, out of descriptors the reserve is given up
+//to take the pending connection and refuse it, otherwise the listener
+//stays readable and the loop spins on it; returns 1 when one was refused
+int accept_failed (struct listener *listener, int error)
+{
+    time_t now = time (NULL);
+    int fd;
+
+    if (now != accept_error_second) {
+        accept_error_second = now;
+        fanout_debug (1, "accept: %s\n", strerror (error));
+    }
+    if (error != EMFILE && error != ENFILE)
+        return 0;
+
+    close (reserve_fd);
+    fd = accept4 (listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd != -1)
+        refuse_client (fd);
+    reserve_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd != -1;
+}
+
+
+//event loop of the io_uring backend, connections are accepted, read and
+//written by the kernel and only the completions are handled here, the
+//epoll set is left with the inbox, signals and metrics behind one
+//multishot poll
+void *uring_run (struct shard *s)
+{
+    uring_init ();
+    for (int n = 0; n < s->listener_count; n++) {
+        uring_accept (&s->listeners[n]);
+    }
+    uring_poll (s);
+
+    while (1) {
+        unsigned head, tail;
+
+        fanout_debug (3, "server waiting for new completions\n");
+        uring_submit (1);
+
+        head = *ring.cq_head;
+        tail = __atomic_load_n (ring.cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            continue;
+        }
+        uint64_t loop_start = shard_pass_start (tail - head);
+
+        for (; head != tail; head++) {
+            uring_complete (s, &ring.cqes[head & ring.cq_mask]);
+        }
+        __atomic_store_n (ring.cq_head, head, __ATOMIC_RELEASE);
+
+        shard_pass_end (loop_start);
+    }//end while (1)
+
+    return NULL;
+}
+
+
+//set up by the thread using it, a single issuer lets the kernel skip
+//locking and run completion work only when the loop waits
+void uring_init ()
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+
+    memset (&p, 0, sizeof (p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN
+              | IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 8;
+    if ((ring.fd = uring_setup (URING_ENTRIES, &p)) == -1
+         && errno == EINVAL) {
+        //kernels before 6.1
+        memset (&p, 0, sizeof (p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_ENTRIES * 8;
+        ring.fd = uring_setup (URING_ENTRIES, &p);
+    }
+    if (ring.fd == -1)
+        fanout_error ("ERROR creating io_uring instance");
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size)
+        sq_size = cq_size;
+    if ((sq = mmap (NULL, sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring.fd,
+                    IORING_OFF_SQ_RING)) == MAP_FAILED)
+        fanout_error ("ERROR mapping io_uring");
+    cq = sq;
+    if ( ! (p.features & IORING_FEAT_SINGLE_MMAP)
+         && (cq = mmap (NULL, cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd,
+                        IORING_OFF_CQ_RING)) == MAP_FAILED)
+        fanout_error ("ERROR mapping io_uring");
+    if ((ring.sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring.fd, IORING_OFF_SQES)) == MAP_FAILED)
+        fanout_error ("ERROR mapping io_uring");
+
+    ring.sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring.sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    ring.sq_entries = p.sq_entries;
+    ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring.cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    //receives pick a free buffer and hand it back once copied out, so
+    //idle connections hold no receive memory
+    if ((ring.buf_ring = mmap (NULL, URING_BUFFERS
+                               * sizeof (struct io_uring_buf),
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+         == MAP_FAILED)
+        fanout_error ("ERROR mapping io_uring buffers");
+    if ((ring.buffers = malloc (URING_BUFFERS * URING_BUFFER_SIZE)) == NULL)
+        fanout_error ("memory error");
+    memset (&reg, 0, sizeof (reg));
+    reg.ring_addr = (uintptr_t) ring.buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = 0;
+    if (syscall (__NR_io_uring_register, ring.fd,
+                 IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        fanout_error ("ERROR registering io_uring buffers");
+    for (u_int id = 0; id < URING_BUFFERS; id++) {
+        uring_buffer_return (id);
+    }
+
+    ring.zerocopy = 1;
+}
+
+
+int uring_setup (unsigned entries, struct io_uring_params *p)
+{
+    return syscall (__NR_io_uring_setup, entries, p);
+}
+
+
+//hand the queued entries to the kernel, waiting for a completion if asked
+void uring_submit (unsigned wait)
+{
+    unsigned pending = *ring.sq_tail - *ring.sq_head;
+
+    if (syscall (__NR_io_uring_enter, ring.fd, pending, wait,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1
+         && errno != EINTR) {
+        fanout_error ("io_uring_enter");
+    }
+}
+
+
+//the kernel only reads the queue when entered, so the entry can be filled
+//in after the tail moved past it
+struct io_uring_sqe *uring_sqe ()
+{
+    unsigned tail = *ring.sq_tail;
+    struct io_uring_sqe *sqe;
+
+    while (tail - __atomic_load_n (ring.sq_head, __ATOMIC_ACQUIRE)
+           >= ring.sq_entries) {
+        uring_submit (0);
+    }
+
+    sqe = &ring.sqes[tail & ring.sq_mask];
+    memset (sqe, 0, sizeof (*sqe));
+    ring.sq_array[tail & ring.sq_mask] = tail & ring.sq_mask;
+    __atomic_store_n (ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+
+void uring_complete (struct shard *s, struct io_uring_cqe *cqe)
+{
+    void *data = (void *) (uintptr_t) (cqe->user_data
+                                       & ~(uint64_t) URING_TAG_MASK);
+
+    switch (cqe->user_data & URING_TAG_MASK) {
+        case URING_ACCEPT:
+            trace_begin (TRACE_ACCEPT);
+            uring_accepted (data, cqe);
+            trace_end ();
+            break;
+        case URING_RECV:
+            uring_received (data, cqe);
+            break;
+        case URING_SEND:
+            trace_begin (TRACE_FLUSH);
+            uring_sent (data, cqe);
+            trace_end ();
+            break;
+        case URING_POLL:
+            uring_polled (s, cqe);
+            break;
+        //the cancelled receive completes on its own
+        case URING_CANCEL:
+            break;
+    }
+}
+
+
+//one submission keeps accepting until the kernel ends it
+void uring_accept (struct listener *listener)
+{
+    struct io_uring_sqe *sqe = uring_sqe ();
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uintptr_t) listener | URING_ACCEPT;
+}
+
+
+void uring_accepted (struct listener *listener, struct io_uring_cqe *cqe)
+{
+    if (cqe->res >= 0) {
+        add_client (cqe->res, time (NULL));
+    } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+        //out of descriptors or memory, the connection is refused so the
+        //accept rearmed below does not fail on it straight away
+        accept_failed (listener, -cqe->res);
+    }
+
+    if ( ! (cqe->flags & IORING_CQE_F_MORE))
+        uring_accept (listener);
+}
+
+
+//one submission keeps receiving into provided buffers until the kernel
+//ends it
+void uring_recv (struct client *c)
+{
+    struct io_uring_sqe *sqe = uring_sqe ();
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (uintptr_t) c | URING_RECV;
+    c->receiving = 1;
+}
+
+
+void uring_received (struct client *c, struct io_uring_cqe *cqe)
+{
+    if ( ! (cqe->flags & IORING_CQE_F_MORE))
+        c->receiving = 0;
+    fanout_probe2 (client_read, c->fd, cqe->res);
+
+    if (cqe->res > 0) {
+        u_int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        //anything arriving once a disconnect is decided on is dropped
+        if ( ! c->released && ! c->closing) {
+            fanout_debug (3, "%d bytes read from client %d\n", cqe->res,
+                           c->fd);
+            trace_begin (TRACE_READ);
+            input_append (&c->input, ring.buffers + id * URING_BUFFER_SIZE,
+                          cqe->res);
+            trace_end ();
+            trace_begin (TRACE_PARSE);
+            client_process_input_buffer (c);
+            trace_end ();
+        }
+        uring_buffer_return (id);
+    } else if (cqe->res == -ENOBUFS) {
+        //every buffer was taken, they are returned by now
+        fanout_debug (3, "out of receive buffers for client %d\n", c->fd);
+    } else if ( ! c->released) {
+        if (cqe->res < 0 && cqe->res != -ECANCELED)
+            fanout_debug (2, "failed reading from client %d: %s\n", c->fd,
+                           strerror (-cqe->res));
+        fanout_debug (2, "client socket disconnected\n");
+        client_close_later (c);
+    }
+
+    if (c->released)
+        uring_client_done (c);
+    else if ( ! c->receiving && ! c->closing)
+        uring_recv (c);
+}
+
+
+void uring_buffer_return (u_int id)
+{
+    unsigned short tail = ring.buf_ring->tail;
+    struct io_uring_buf *buf = &ring.buf_ring->bufs[tail
+                                                    & (URING_BUFFERS - 1)];
+
+    buf->addr = (uintptr_t) (ring.buffers + id * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = id;
+    __atomic_store_n (&ring.buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+//one send in flight per client keeps the stream in order, the messages
+//stay queued until its result is in
+void uring_send (struct client *c)
+{
+    struct output_queue *q = &c->output_queue;
+    struct uring_send *send;
+    struct io_uring_sqe *sqe;
+    size_t length = 0;
+
+    if (c->send != NULL || q->count == 0)
+        return;
+
+    if ((send = uring_send_free) != NULL) {
+        uring_send_free = send->next;
+    } else if ((send = malloc (sizeof (struct uring_send))) == NULL) {
+        fanout_error ("memory error");
+    }
+    send->count = 0;
+
+    //gather as many queued messages as fit in a single sendmsg
+    for (u_int i = 0; i < q->count && send->count < URING_SEND_MESSAGES;
+          i++) {
+        struct message *m = q->messages[(q->start + i) & (q->size - 1)];
+        size_t skip = (i == 0) ? q->offset : 0;
+
+        message_retain (m);
+        send->messages[send->count] = m;
+        send->iov[send->count].iov_base = m->data + skip;
+        send->iov[send->count].iov_len = m->length - skip;
+        length += m->length - skip;
+        send->count++;
+    }
+    memset (&send->msg, 0, sizeof (send->msg));
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = send->count;
+    send->client = c;
+    //like bytes taken by the socket they no longer count against
+    //max_output_buffer, so a stalled send doesn't stop newer messages
+    //from being queued
+    send->length = length;
+    q->length -= length;
+    send->zerocopy = ring.zerocopy
+                     && length >= URING_ZEROCOPY_MIN * send->count;
+    c->send = send;
+
+    sqe = uring_sqe ();
+    sqe->opcode = send->zerocopy ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t) &send->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t) send | URING_SEND;
+}
+
+
+//a zero copy send completes twice, with its result and then once the
+//kernel no longer reads the messages
+void uring_sent (struct uring_send *send, struct io_uring_cqe *cqe)
+{
+    struct client *c = send->client;
+
+    if ( ! (cqe->flags & IORING_CQE_F_NOTIF) && c != NULL) {
+        struct output_queue *q = &c->output_queue;
+
+        send->client = NULL;
+        c->send = NULL;
+
+        if (c->released) {
+            uring_client_done (c);
+        } else if (send->zerocopy && (cqe->res == -EINVAL
+                                      || cqe->res == -EOPNOTSUPP)) {
+            fanout_debug (1, "zero copy sends unsupported, copying\n");
+            ring.zerocopy = 0;
+            q->length += send->length;
+            client_flush_later (c);
+        } else {
+            size_t sent = cqe->res;
+
+            q->length += send->length;
+            if (cqe->res < 0) {
+                //the read side will notice the broken connection
+                fanout_debug (3, "failed writing to client %d: %s\n", c->fd,
+                               strerror (-cqe->res));
+                sent = q->length;
+            }
+            fanout_debug (3, "wrote %d bytes\n", (int) sent);
+            output_queue_advance (q, sent);
+            if (q->count > 0)
+                client_flush_later (c);
+        }
+    }
+
+    if ( ! (cqe->flags & IORING_CQE_F_MORE)) {
+        for (u_int i = 0; i < send->count; i++) {
+            message_release (send->messages[i]);
+        }
+        send->next = uring_send_free;
+        uring_send_free = send;
+    }
+}
+
+
+//wakes the loop whenever the epoll set has events
+void uring_poll (struct shard *s)
+{
+    struct io_uring_sqe *sqe = uring_sqe ();
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s->epollfd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uintptr_t) s | URING_POLL;
+}
+
+
+void uring_polled (struct shard *s, struct io_uring_cqe *cqe)
+{
+    struct epoll_event events[max_events];
+    int nevents;
+
+    do {
+        if ((nevents = epoll_wait (epollfd, events, max_events, 0)) == -1) {
+            if (errno != EINTR)
+                fanout_error ("epoll_wait");
+            nevents = max_events;
+            continue;
+        }
+        for (int n = 0; n < nevents; n++) {
+            shard_dispatch (s, &events[n]);
+        }
+    } while (nevents == max_events);
+
+    if ( ! (cqe->flags & IORING_CQE_F_MORE))
+        uring_poll (s);
+}
+
+
+void uring_cancel (struct client *c)
+{
+    struct io_uring_sqe *sqe;
+
+    if ( ! c->receiving)
+        return;
+
+    sqe = uring_sqe ();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) c | URING_RECV;
+    sqe->user_data = URING_CANCEL;
+}
+
+
+//a destroyed client is freed once the ring no longer refers to it
+void uring_client_done (struct client *c)
+{
+    if (c->released && ! c->receiving && c->send == NULL)
+        pool_free (&pools[POOL_CLIENT], c);
+}
+
+
+void inbox_init (struct inbox *q)
+{
+    q->type = FD_TYPE_INBOX;
+    if ((q->fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        fanout_error ("ERROR creating eventfd");
+    }
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+    q->signalled = 0;
+}
+
+
+void inbox_push (struct inbox *q, struct inbox_item *item)
+{
+    item->next = NULL;
+    struct inbox_item *previous = __atomic_exchange_n (&q->tail, item,
+                                                       __ATOMIC_ACQ_REL);
+    __atomic_store_n (&previous->next, item, __ATOMIC_RELEASE);
+}
+
+
+struct inbox_item *inbox_pop (struct inbox *q)
+{
+    struct inbox_item *head = q->head;
+    struct inbox_item *next = __atomic_load_n (&head->next, __ATOMIC_ACQUIRE);
+
+    if (head == &q->stub) {
+        if (next == NULL)
+            return NULL;
+        q->head = next;
+        head = next;
+        next = __atomic_load_n (&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        q->head = next;
+        return head;
+    }
+
+    //a producer is part way through a push, it signals again once done
+    if (head != __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    //requeue the stub so the last item can be handed out
+    inbox_push (q, &q->stub);
+    next = __atomic_load_n (&head->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        q->head = next;
+        return head;
+    }
+    return NULL;
+}
+
+
+void shard_init (struct shard *s, u_int id)
+{
+    struct epoll_event ev;
+
+    s->id = id;
+    s->interest_epoch = INTEREST_OFFLINE;
+    if((s->epollfd = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+        fanout_error ("ERROR creating epoll instance");
+
+    inbox_init (&s->inbox);
+    ev.events = EPOLLIN;
+    ev.data.ptr = &s->inbox;
+    if (epoll_ctl (s->epollfd, EPOLL_CTL_ADD, s->inbox.fd, &ev) == -1) {
+        fanout_error ("epoll_ctl: inbox");
+    }
+}
+
+
+void shard_listen (struct shard *s, struct addrinfo *ai,
+                   u_int listen_backlog)
+{
+    int nfds = 0;
+    struct addrinfo *runp = ai;
+    while (runp != NULL) {
+        ++nfds;
+        runp = runp->ai_next;
+    }
+    if ((s->listeners = calloc (nfds, sizeof (struct listener))) == NULL) {
+        fanout_error ("memory error");
+    }
+    struct listener *listeners = s->listeners;
+
+    for (nfds = 0, runp = ai; runp != NULL; runp = runp->ai_next)  {
+        listeners[nfds].type = FD_TYPE_LISTENER;
+        listeners[nfds].fd = listen_socket (runp, listen_backlog);
+        ++nfds;
+    }
+    s->listener_count = nfds;
+}
+
+
+//a bound, listening socket for one address
+int listen_socket (struct addrinfo *runp, u_int listen_backlog)
+{
+    int fd;
+    int optval;
+    socklen_t optlen = sizeof(optval);
+    struct linger so_linger;
+
+    fd = socket (runp->ai_family, runp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, runp->ai_protocol);
+    if (fd == -1) {
+        fanout_error ("ERROR opening socket");
+        exit (EXIT_FAILURE);
+    }
+
+    optval = 1;
+    if (runp->ai_family==AF_INET6 && setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, optlen) == -1) {
+        fanout_error ("failed setting IPV6_V6ONLY");
+        exit (EXIT_FAILURE);
+    }
+
+    optval = 1;
+    if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &optval, optlen) == -1) {
+        fanout_error ("failed setting REUSEADDR");
+        exit (EXIT_FAILURE);
+    }
+
+    optval = 1;
+    if (shard_count > 1 && listen_mode == LISTEN_REUSEPORT && setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &optval, optlen) == -1) {
+        fanout_error ("failed setting REUSEPORT");
+        exit (EXIT_FAILURE);
+    }
+
+    //inherited by accepted connections
+    optval = 1;
+    if (setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &optval, optlen) == -1) {
+        fanout_error ("failed setting keepalive");
+        exit (EXIT_FAILURE);
+    }
+
+    // immediately discard any remaining data on close
+    so_linger.l_onoff = 1;
+    so_linger.l_linger = 0;
+    if (setsockopt (fd, SOL_SOCKET, SO_LINGER, &so_linger, sizeof so_linger) == -1) {
+        fanout_error ("failed setting linger");
+        exit (EXIT_FAILURE);
+    }
+
+    if (bind (fd, runp->ai_addr, runp->ai_addrlen ) != 0) {
+        fanout_error ("ERROR on binding");
+        exit (EXIT_FAILURE);
+    }
+    if (listen (fd, listen_backlog) != 0) {
+        fanout_error ("ERROR listening on server socket");
+        exit (EXIT_FAILURE);
+    }
+    return fd;
+}
+
+
+void shard_watch_listeners (struct shard *s)
+{
+    struct epoll_event ev;
+
+    for (int n = 0; n < s->listener_count; n++) {
+        ev.events = EPOLLIN;
+        //shared listeners wake one of the waiting event loops
+        if (listen_mode == LISTEN_EXCLUSIVE && shard_count > 1)
+            ev.events |= EPOLLEXCLUSIVE;
+        ev.data.ptr = &s->listeners[n];
+        if (epoll_ctl (s->epollfd, EPOLL_CTL_ADD, s->listeners[n].fd, &ev) == -1) {
+            fanout_error ("epoll_ctl: srvsock");
+            exit (EXIT_FAILURE);
+        }
+    }
+}
+
+
+void shard_process_inbox (struct shard *s)
+{
+    struct inbox_item *item;
+    uint64_t value;
+
+    if (read (s->inbox.fd, &value, sizeof (value)) == -1 && errno != EAGAIN) {
+        fanout_debug (1, "failed reading inbox eventfd: %s\n",
+                       strerror (errno));
+    }
+    //cleared before draining so that later pushes signal again
+    __atomic_exchange_n (&s->inbox.signalled, 0, __ATOMIC_SEQ_CST);
+
+    while ((item = inbox_pop (&s->inbox)) != NULL) {
+        struct message *m = item->message;
+        free (item);
+
+        deliver_local (m->data, m->channel_length, m);
+        message_release (m);
+    }
+}
+
+
+void *pool_alloc (struct pool *p)
+{
+    struct pool_slab *slab = p->partial;
+    void *object;
+
+    if (slab == NULL) {
+        if (p->spare != NULL) {
+            slab = p->spare;
+            p->spare = NULL;
+        } else if ((slab = pool_slab_create (p)) == NULL) {
+            return NULL;
+        }
+        pool_slab_link (p, slab);
+    }
+
+    if (slab->free_head != NULL) {
+        object = slab->free_head;
+        slab->free_head = *(void **) object;
+    } else {
+        object = (char *) slab + POOL_HEADER_SIZE
+                 + slab->carved++ * p->object_size;
+    }
+    if (++slab->used == p->slab_objects)
+        pool_slab_unlink (p, slab);
+    p->used++;
+
+    memset (object, 0, p->object_size);
+    return object;
+}
+
+
+//the slab is found from the object's address, slabs are aligned to their
+//size
+void pool_free (struct pool *p, void *object)
+{
+    struct pool_slab *slab = (struct pool_slab *)
+        ((uintptr_t) object & ~((uintptr_t) POOL_SLAB_SIZE - 1));
+
+    if (slab->used == p->slab_objects)
+        pool_slab_link (p, slab);
+    *(void **) object = slab->free_head;
+    slab->free_head = object;
+    p->used--;
+
+    //hand memory back once a slab empties, keeping one for reuse
+    if (--slab->used == 0) {
+        pool_slab_unlink (p, slab);
+        if (p->spare == NULL) {
+            p->spare = slab;
+        } else {
+            munmap (slab, POOL_SLAB_SIZE);
+            p->slab_count--;
+        }
+    }
+}
+
+
+struct pool_slab *pool_slab_create (struct pool *p)
+{
+    char *map;
+    uintptr_t start;
+
+    //map twice the size and trim to get an aligned slab
+    if ((map = mmap (NULL, 2 * POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        return NULL;
+    }
+    start = ((uintptr_t) map + POOL_SLAB_SIZE - 1)
+            & ~((uintptr_t) POOL_SLAB_SIZE - 1);
+    if (start > (uintptr_t) map)
+        munmap (map, start - (uintptr_t) map);
+    munmap ((char *) start + POOL_SLAB_SIZE,
+            (uintptr_t) map + POOL_SLAB_SIZE - start);
+
+    struct pool_slab *slab = (struct pool_slab *) start;
+    slab->next = NULL;
+    slab->previous = NULL;
+    slab->free_head = NULL;
+    slab->used = 0;
+    slab->carved = 0;
+    p->slab_count++;
+    return slab;
+}
+
+
+void pool_slab_link (struct pool *p, struct pool_slab *slab)
+{
+    slab->previous = NULL;
+    slab->next = p->partial;
+    if (p->partial != NULL)
+        p->partial->previous = slab;
+    p->partial = slab;
+}
+
+
+void pool_slab_unlink (struct pool *p, struct pool_slab *slab)
+{
+    if (slab->next != NULL)
+        slab->next->previous = slab->previous;
+    if (slab->previous != NULL)
+        slab->previous->next = slab->next;
+    if (slab == p->partial)
+        p->partial = slab->next;
+    slab->next = NULL;
+    slab->previous = NULL;
+}
+
+
+void stats_total (struct stats *total)
+{
+    time_t now = time (NULL);
+
+    memset (total, 0, sizeof (struct stats));
+
+    //other shards keep counting while this runs, totals are approximate
+    for (u_int i = 0; i < shard_count; i++) {
+        struct stats *shard_stats = shards[i].stats;
+        if (shard_stats == NULL)
+            continue;
+        total->announcements_count += shard_stats->announcements_count;
+        total->messages_count += shard_stats->messages_count;
+        total->subscriptions_count += shard_stats->subscriptions_count;
+        total->unsubscriptions_count += shard_stats->unsubscriptions_count;
+        total->pings_count += shard_stats->pings_count;
+        total->clients_count += shard_stats->clients_count;
+        total->client_limit_count += shard_stats->client_limit_count;
+        total->slow_consumer_disconnects_count +=
+            shard_stats->slow_consumer_disconnects_count;
+        total->dropped_oldest_count += shard_stats->dropped_oldest_count;
+        total->dropped_newest_count += shard_stats->dropped_newest_count;
+        total->coalesced_count += shard_stats->coalesced_count;
+        total->event_waits_count += shard_stats->event_waits_count;
+        total->events_count += shard_stats->events_count;
+        total->current_channel_count += shard_stats->current_channel_count;
+        total->current_subscription_count +=
+            shard_stats->current_subscription_count;
+        total->current_pattern_count += shard_stats->current_pattern_count;
+        total->current_history_count += shard_stats->current_history_count;
+        total->current_history_length +=
+            shard_stats->current_history_length;
+        total->current_idle_channel_count +=
+            shard_stats->current_idle_channel_count;
+        total->evicted_channels_count += shard_stats->evicted_channels_count;
+
+        //the last complete second, as seen from now
+        if (shard_stats->accept_second == now - 1)
+            total->accepts_last_second += shard_stats->accept_second_count;
+        else if (shard_stats->accept_second == now)
+            total->accepts_last_second += shard_stats->accepts_last_second;
+        total->max_accepts_per_second += shard_stats->max_accepts_per_second;
+
+        for (int type = 0; type < POOL_COUNT && shards[i].pools; type++) {
+            struct pool *p = &shards[i].pools[type];
+            total->pool_used[type] += p->used;
+            total->pool_capacity[type] += p->slab_count * p->slab_objects;
+        }
+
+        histogram_add (&total->fanout_histogram,
+                       &shard_stats->fanout_histogram);
+        histogram_add (&total->announce_histogram,
+                       &shard_stats->announce_histogram);
+        histogram_add (&total->output_queue_histogram,
+                       &shard_stats->output_queue_histogram);
+        histogram_add (&total->loop_histogram, &shard_stats->loop_histogram);
+        for (int stage = 0; stage < TRACE_STAGE_COUNT; stage++) {
+            histogram_add (&total->trace_histograms[stage],
+                           &shard_stats->trace_histograms[stage]);
+        }
+    }
+
+    //a channel is counted once however many shards it lives on
+    if (shard_count > 1)
+        total->current_channel_count = interest_count ();
+}
+
+
+void histogram_observe (struct histogram *h, unsigned long long first,
+                        unsigned long long value)
+{
+    unsigned long long multiple = (value + first - 1) / first;
+    u_int bucket = 0;
+
+    //the number of doublings of the first bound needed to cover value
+    if (multiple > 1)
+        bucket = 64 - __builtin_clzll (multiple - 1);
+    if (bucket > HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS;
+
+    h->buckets[bucket]++;
+    h->count++;
+    h->sum += value;
+}
+
+
+void histogram_add (struct histogram *total, struct histogram *h)
+{
+    for (int i = 0; i <= HISTOGRAM_BUCKETS; i++) {
+        total->buckets[i] += h->buckets[i];
+    }
+    total->count += h->count;
+    total->sum += h->sum;
+}
+
+
+uint64_t monotonic_ns ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+//not slewed by NTP, read from the TSC through the vDSO
+uint64_t trace_now ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void trace_push (enum trace_stage stage)
+{
+    //stages nested deeper than the stack are counted in their parent
+    if (trace_depth < TRACE_DEPTH) {
+        trace_stack[trace_depth].stage = stage;
+        trace_stack[trace_depth].nested = 0;
+        trace_stack[trace_depth].start = trace_now ();
+    }
+    trace_depth++;
+}
+
+
+void trace_pop ()
+{
+    struct trace_frame *frame;
+    uint64_t elapsed;
+
+    if (--trace_depth >= TRACE_DEPTH)
+        return;
+
+    frame = &trace_stack[trace_depth];
+    elapsed = trace_now () - frame->start;
+    histogram_observe (&stats.trace_histograms[frame->stage],
+                       HISTOGRAM_TRACE_FIRST, elapsed - frame->nested);
+    if (trace_depth > 0)
+        trace_stack[trace_depth - 1].nested += elapsed;
+}
+
+
+//upper bound of the bucket holding the given fraction of observations
+unsigned long long histogram_percentile (struct histogram *h,
+                                         unsigned long long first,
+                                         double fraction)
+{
+    unsigned long long count = 0;
+    unsigned long long total = 0;
+
+    for (int i = 0; i <= HISTOGRAM_BUCKETS; i++) {
+        total += h->buckets[i];
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += h->buckets[i];
+        if (count >= fraction * total)
+            return first << i;
+    }
+    return first << HISTOGRAM_BUCKETS;
+}
+
+
+//time per stage summed across shards, with each stage's share of the time
+//traced
+char *trace_report ()
+{
+    struct stats total;
+    unsigned long long traced = 0;
+    char *report = NULL;
+    char *line;
+
+    stats_total (&total);
+    for (int stage = 0; stage < TRACE_STAGE_COUNT; stage++) {
+        traced += total.trace_histograms[stage].sum;
+    }
+
+    asprintf (&line, "trace sample: %u\n", trace_sample);
+    report = str_append (report, line);
+    free (line);
+
+    for (int stage = 0; stage < TRACE_STAGE_COUNT; stage++) {
+        struct histogram *h = &total.trace_histograms[stage];
+
+        asprintf (&line, "%s: %llu samples, mean %llu ns, p50 <= %llu ns, \
+p99 <= %llu ns, %.1f%%\n", trace_stage_names[stage], h->count,
+                  h->count ? h->sum / h->count : 0,
+                  histogram_percentile (h, HISTOGRAM_TRACE_FIRST, 0.5),
+                  histogram_percentile (h, HISTOGRAM_TRACE_FIRST, 0.99),
+                  traced ? 100.0 * h->sum / traced : 0.0);
+        report = str_append (report, line);
+        free (line);
+    }
+    return report;
+}
+
+
+void trace_signal_init ()
+{
+    struct epoll_event ev;
+    sigset_t mask;
+
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGUSR1);
+    if (pthread_sigmask (SIG_BLOCK, &mask, NULL) != 0)
+        fanout_error ("ERROR blocking SIGUSR1");
+
+    if ((trace_signal.fd = signalfd (-1, &mask,
+                                     SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+        fanout_error ("ERROR creating signalfd");
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &trace_signal;
+    if (epoll_ctl (shards[0].epollfd, EPOLL_CTL_ADD, trace_signal.fd,
+                   &ev) == -1) {
+        fanout_error ("epoll_ctl: signalfd");
+    }
+}
+
+
+void trace_signal_read ()
+{
+    struct signalfd_siginfo info;
+    char *report;
+
+    while (read (trace_signal.fd, &info, sizeof (info)) == sizeof (info)) {
+        report = trace_report ();
+        //asked for explicitly, logged whatever the debug level
+        fanout_log (2, "trace report\n%s", report);
+        free (report);
+    }
+}
+
+
+void interest_add (const char *channel_name, size_t channel_length,
+                   u_int hash, u_int shard_id)
+{
+    struct interest_stripe *stripe =
+        &interest_stripes[hash & (INTEREST_STRIPES - 1)];
+    struct interest_table *table;
+    struct interest *interest_i = NULL;
+
+    pthread_mutex_lock (&stripe->lock);
+
+    table = stripe->table;
+    if (table != NULL) {
+        interest_i = table->buckets[(hash / INTEREST_STRIPES)
+                                    & (table->size - 1)];
+        while (interest_i != NULL) {
+            if (interest_i->hash == hash
+                 && interest_i->name_length == channel_length
+                 && ! memcmp (interest_i->name, channel_name, channel_length))
+                break;
+            interest_i = interest_i->next;
+        }
+    }
+
+    if (interest_i == NULL) {
+        //keep the load factor at or below 1
+        if (table == NULL || stripe->count >= table->size) {
+            u_int size = table ? table->size * 2 : 16;
+            struct interest_table *resized;
+
+            if ((resized = calloc (1, sizeof (struct interest_table)
+                                   + size * sizeof (struct interest *)))
+                 == NULL) {
+                fanout_error ("memory error");
+            }
+            resized->size = size;
+
+            __atomic_store_n (&stripe->sequence, stripe->sequence + 1,
+                              __ATOMIC_RELAXED);
+            __atomic_thread_fence (__ATOMIC_RELEASE);
+            for (u_int i = 0; table != NULL && i < table->size; i++) {
+                while (table->buckets[i] != NULL) {
+                    struct interest *interest_tmp = table->buckets[i];
+                    u_int bucket = (interest_tmp->hash / INTEREST_STRIPES)
+                                   & (size - 1);
+                    __atomic_store_n (&table->buckets[i], interest_tmp->next,
+                                      __ATOMIC_RELAXED);
+                    __atomic_store_n (&interest_tmp->next,
+                                      resized->buckets[bucket],
+                                      __ATOMIC_RELAXED);
+                    resized->buckets[bucket] = interest_tmp;
+                }
+            }
+            __atomic_store_n (&stripe->table, resized, __ATOMIC_RELEASE);
+            __atomic_store_n (&stripe->sequence, stripe->sequence + 1,
+                              __ATOMIC_RELEASE);
+
+            if (table != NULL) {
+                table->retired_epoch = __atomic_add_fetch (&interest_epoch, 1,
+                                                           __ATOMIC_SEQ_CST);
+                table->retired_next = retired_tables;
+                retired_tables = table;
+            }
+            table = resized;
+        }
+
+        if ((interest_i = calloc (1, sizeof (struct interest)
+                                  + channel_length)) == NULL) {
+            fanout_error ("memory error");
+        }
+        memcpy (interest_i->name, channel_name, channel_length);
+        interest_i->name_length = channel_length;
+        interest_i->hash = hash;
+
+        u_int bucket = (hash / INTEREST_STRIPES) & (table->size - 1);
+        interest_i->next = table->buckets[bucket];
+        __atomic_store_n (&table->buckets[bucket], interest_i,
+                          __ATOMIC_RELEASE);
+        stripe->count++;
+    }
+
+    __atomic_or_fetch (&interest_i->shards, (uint64_t) 1 << shard_id,
+                       __ATOMIC_RELAXED);
+    pthread_mutex_unlock (&stripe->lock);
+}
+
+
+void interest_remove (const char *channel_name, size_t channel_length,
+                      u_int hash, u_int shard_id)
+{
+    struct interest_stripe *stripe =
+        &interest_stripes[hash & (INTEREST_STRIPES - 1)];
+
+    pthread_mutex_lock (&stripe->lock);
+
+    if (stripe->table != NULL) {
+        struct interest **link =
+            &stripe->table->buckets[(hash / INTEREST_STRIPES)
+                                    & (stripe->table->size - 1)];
+        while (*link != NULL) {
+            struct interest *interest_i = *link;
+            if (interest_i->hash == hash
+                 && interest_i->name_length == channel_length
+                 && ! memcmp (interest_i->name, channel_name, channel_length)) {
+                if (__atomic_and_fetch (&interest_i->shards,
+                                        ~((uint64_t) 1 << shard_id),
+                                        __ATOMIC_RELAXED) == 0) {
+                    //readers already on it go on to the next entry
+                    __atomic_store_n (link, interest_i->next,
+                                      __ATOMIC_RELEASE);
+                    interest_i->retired_epoch =
+                        __atomic_add_fetch (&interest_epoch, 1,
+                                            __ATOMIC_SEQ_CST);
+                    interest_i->retired_next = retired_interests;
+                    retired_interests = interest_i;
+                    stripe->count--;
+                }
+                break;
+            }
+            link = &interest_i->next;
+        }
+    }
+
+    pthread_mutex_unlock (&stripe->lock);
+}
+
+
+//no lock, every shard announcing on a hot channel would contend for its
+//stripe otherwise; a lookup overlapping a resize is done again
+uint64_t interest_get (const char *channel_name, size_t channel_length,
+                       u_int hash)
+{
+    struct interest_stripe *stripe =
+        &interest_stripes[hash & (INTEREST_STRIPES - 1)];
+    uint64_t shards;
+    u_int sequence;
+
+    do {
+        struct interest_table *table;
+        struct interest *interest_i = NULL;
+
+        sequence = __atomic_load_n (&stripe->sequence, __ATOMIC_ACQUIRE);
+        shards = 0;
+        table = __atomic_load_n (&stripe->table, __ATOMIC_ACQUIRE);
+        if (table != NULL)
+            interest_i = __atomic_load_n (
+                &table->buckets[(hash / INTEREST_STRIPES) & (table->size - 1)],
+                __ATOMIC_ACQUIRE);
+        while (interest_i != NULL) {
+            if (interest_i->hash == hash
+                 && interest_i->name_length == channel_length
+                 && ! memcmp (interest_i->name, channel_name, channel_length)) {
+                shards = __atomic_load_n (&interest_i->shards,
+                                          __ATOMIC_RELAXED);
+                break;
+            }
+            interest_i = __atomic_load_n (&interest_i->next, __ATOMIC_ACQUIRE);
+        }
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    } while ((sequence & 1)
+              || __atomic_load_n (&stripe->sequence, __ATOMIC_RELAXED)
+                 != sequence);
+
+    return shards;
+}
+
+
+u_int interest_count ()
+{
+    u_int count = 0;
+
+    for (u_int i = 0; i < INTEREST_STRIPES; i++) {
+        pthread_mutex_lock (&interest_stripes[i].lock);
+        count += interest_stripes[i].count;
+        pthread_mutex_unlock (&interest_stripes[i].lock);
+    }
+    return count;
+}
+
+
+//called as a pass ends, what this shard retired is freed once every
+//shard is between passes or in one that started after the retirement
+void interest_reclaim ()
+{
+    uint64_t oldest = INTEREST_OFFLINE;
+
+    __atomic_store_n (&current_shard->interest_epoch, INTEREST_OFFLINE,
+                      __ATOMIC_SEQ_CST);
+    if (retired_interests == NULL && retired_tables == NULL)
+        return;
+
+    for (u_int i = 0; i < shard_count; i++) {
+        uint64_t epoch = __atomic_load_n (&shards[i].interest_epoch,
+                                          __ATOMIC_SEQ_CST);
+        if (epoch < oldest)
+            oldest = epoch;
+    }
+
+    struct interest **link = &retired_interests;
+    while (*link != NULL) {
+        struct interest *interest_i = *link;
+        if (interest_i->retired_epoch <= oldest) {
+            *link = interest_i->retired_next;
+            free (interest_i);
+        } else {
+            link = &interest_i->retired_next;
+        }
+    }
+
+    struct interest_table **table_link = &retired_tables;
+    while (*table_link != NULL) {
+        struct interest_table *table = *table_link;
+        if (table->retired_epoch <= oldest) {
+            *table_link = table->retired_next;
+            free (table);
+        } else {
+            table_link = &table->retired_next;
+        }
+    }
+}
+
+
+u_int channel_hash (const char *channel_name, size_t channel_length)
+{
+    //FNV-1a
+    u_int hash = 2166136261u;
+    for (size_t i = 0; i < channel_length; i++) {
+        hash ^= (unsigned char) channel_name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+void channel_table_resize (u_int size)
+{
+    struct channel **new_table;
+
+    if ((new_table = calloc (size, sizeof (struct channel *))) == NULL) {
+        fanout_error ("memory error");
+    }
+
+    for (u_int i = 0; i < channel_table_size; i++) {
+        struct channel *channel_i = channel_table[i];
+        while (channel_i != NULL) {
+            struct channel *channel_tmp = channel_i;
+            channel_i = channel_i->next;
+
+            u_int bucket = channel_tmp->hash & (size - 1);
+            channel_tmp->previous = NULL;
+            channel_tmp->next = new_table[bucket];
+            if (new_table[bucket] != NULL)
+                new_table[bucket]->previous = channel_tmp;
+            new_table[bucket] = channel_tmp;
+        }
+    }
+
+    fanout_debug (3, "resized channel table from %d to %d buckets\n",
+                   channel_table_size, size);
+    free (channel_table);
+    channel_table = new_table;
+    channel_table_size = size;
+}
+
+
+struct channel *find_channel (const char *channel_name,
+                              size_t channel_length)
+{
+    if (channel_table == NULL)
+        return NULL;
+
+    u_int hash = channel_hash (channel_name, channel_length);
+    struct channel *channel_i = channel_table[hash & (channel_table_size - 1)];
+
+    while (channel_i != NULL) {
+        if (channel_i->hash == hash && channel_i->name_length == channel_length
+             && ! memcmp (channel_name, channel_i->name, channel_length))
+            return channel_i;
+        channel_i = channel_i->next;
+    }
+    return NULL;
+}
+
+
+int channel_has_subscription (struct channel *c)
+{
+    if (c->subscription_count > 0) {
+        return 1;
+    }
+    return 0;
+}
+
+
+struct channel *get_channel (const char *channel_name,
+                             size_t channel_length)
+{
+    struct channel *channel_i;
+
+    if ((channel_i = find_channel (channel_name, channel_length)) != NULL)
+        return channel_i;
+
+    fanout_debug (2, "creating new channel %.*s\n", (int) channel_length,
+                   channel_name);
+    if ((channel_i = pool_alloc (&pools[POOL_CHANNEL])) == NULL) {
+        fanout_error ("memory error");
+    }
+
+    //keep the load factor at or below 1
+    if (stats.current_channel_count >= channel_table_size)
+        channel_table_resize (channel_table_size ? channel_table_size * 2 : 64);
+
+    channel_set_name (channel_i, channel_name, channel_length);
+    channel_i->hash = channel_hash (channel_name, channel_length);
+
+    u_int bucket = channel_i->hash & (channel_table_size - 1);
+    channel_i->next = channel_table[bucket];
+    if (channel_table[bucket] != NULL)
+        channel_table[bucket]->previous = channel_i;
+    channel_table[bucket] = channel_i;
+    stats.current_channel_count++;
+
+    if (shard_count > 1)
+        interest_add (channel_i->name, channel_length, channel_i->hash,
+                      current_shard->id);
+    return channel_i;
+}
+
+
+void remove_channel (struct channel *c)
+{
+    if (c->pattern != NULL) {
+        remove_pattern (c);
+        return;
+    }
+
+    fanout_debug (2, "removing unused channel %s\n", c->name);
+    if (c->next != NULL) {
+        c->next->previous = c->previous;
+    }
+    if (c->previous != NULL) {
+        c->previous->next = c->next;
+    }
+    u_int bucket = c->hash & (channel_table_size - 1);
+    if (c == channel_table[bucket]) {
+        channel_table[bucket] = c->next;
+    }
+    stats.current_channel_count--;
+
+    if (shard_count > 1)
+        interest_remove (c->name, c->name_length, c->hash, current_shard->id);
+}
+
+
+void destroy_channel (struct channel *c)
+{
+    channel_busy (c);
+    while (c->history.count > 0)
+        history_drop_oldest (c);
+    free (c->history.messages);
+    if (c->name != c->inline_name)
+        free (c->name);
+    pool_free (&pools[POOL_CHANNEL], c);
+}
+
+
+void channel_set_name (struct channel *c, const char *name, size_t length)
+{
+    if (length < sizeof (c->inline_name)) {
+        c->name = c->inline_name;
+    } else if ((c->name = malloc (length + 1)) == NULL) {
+        fanout_error ("memory error");
+    }
+    memcpy (c->name, name, length);
+    c->name[length] = '\0';
+    c->name_length = length;
+}
+
+
+//keep a reference to a numbered message, the block is the one subscribers
+//are sent so nothing is copied
+void history_push (struct channel *c, struct message *m)
+{
+    struct history *h = &c->history;
+
+    while (h->count > 0 && (h->count >= history_messages
+            || (history_bytes > 0 && h->length + m->length > history_bytes)))
+        history_drop_oldest (c);
+    if (history_bytes > 0 && m->length > history_bytes)
+        return;
+
+    if (h->count == h->size) {
+        u_int size = h->size ? h->size * 2 : 16;
+        struct message **messages;
+
+        if (size > history_messages)
+            size = history_messages;
+        //the ring is indexed with a mask
+        while (size & (size - 1))
+            size++;
+
+        if ((messages = malloc (size * sizeof (struct message *))) == NULL) {
+            fanout_error ("ERROR unable to allocate memory");
+        }
+        for (u_int i = 0; i < h->count; i++) {
+            messages[i] = h->messages[(h->start + i) & (h->size - 1)];
+        }
+        free (h->messages);
+        h->messages = messages;
+        h->size = size;
+        h->start = 0;
+    }
+
+    message_retain (m);
+    h->messages[(h->start + h->count) & (h->size - 1)] = m;
+    h->count++;
+    h->length += m->length;
+    stats.current_history_count++;
+    stats.current_history_length += m->length;
+}
+
+
+void history_drop_oldest (struct channel *c)
+{
+    struct history *h = &c->history;
+    struct message *m = h->messages[h->start];
+
+    h->start = (h->start + 1) & (h->size - 1);
+    h->count--;
+    h->length -= m->length;
+    stats.current_history_count--;
+    stats.current_history_length -= m->length;
+    message_release (m);
+}
+
+
+//a channel left with history but no subscribers, or announced to again
+//while it has none, moves to the end of the idle list
+void channel_idle (struct channel *c)
+{
+    if (c->idle && c == idle_tail)
+        return;
+
+    channel_busy (c);
+    c->idle = 1;
+    c->idle_previous = idle_tail;
+    if (idle_tail != NULL)
+        idle_tail->idle_next = c;
+    else
+        idle_head = c;
+    idle_tail = c;
+    stats.current_idle_channel_count++;
+}
+
+
+void channel_busy (struct channel *c)
+{
+    if ( ! c->idle)
+        return;
+
+    if (c->idle_previous != NULL)
+        c->idle_previous->idle_next = c->idle_next;
+    else
+        idle_head = c->idle_next;
+    if (c->idle_next != NULL)
+        c->idle_next->idle_previous = c->idle_previous;
+    else
+        idle_tail = c->idle_previous;
+    c->idle_next = NULL;
+    c->idle_previous = NULL;
+    c->idle = 0;
+    stats.current_idle_channel_count--;
+}
+
+
+//drop the channels announced to longest ago, with their history, once more
+//than history_channels are kept for it alone
+void evict_idle_channels ()
+{
+    while (history_channels > 0
+            && stats.current_idle_channel_count > history_channels) {
+        struct channel *c = idle_head;
+
+        fanout_debug (2, "evicting idle channel %s\n", c->name);
+        remove_channel (c);
+        destroy_channel (c);
+        if (stats.evicted_channels_count == ULLONG_MAX) {
+            fanout_debug (1, "wow, you've evicted alot..resetting counter\n");
+            stats.evicted_channels_count = 0;
+        }
+        stats.evicted_channels_count++;
+    }
+}
+
+
+//send the binary client every kept message newer than since, followed by
+//the range that was replayed so gaps can be detected
+void history_replay (struct client *c, struct channel *channel,
+                     unsigned long long since)
+{
+    struct history *h = &channel->history;
+    unsigned long long first = h->seq + 1;
+    char range[16];
+
+    for (u_int i = 0; i < h->count; i++) {
+        struct message *m = h->messages[(h->start + i) & (h->size - 1)];
+        if (m->seq <= since)
+            continue;
+        if (m->seq < first)
+            first = m->seq;
+
+        struct message *frame = message_frame (m);
+        client_write_message (c, frame);
+        message_release (frame);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        range[i] = first >> (56 - 8 * i);
+        range[8 + i] = h->seq >> (56 - 8 * i);
+    }
+    struct message *frame = frame_create (FRAME_REPLAYED, 0, channel->name,
+                                          channel->name_length, range,
+                                          sizeof (range));
+    client_write_message (c, frame);
+    message_release (frame);
+}
+
+
+int channel_durable (const char *channel_name, size_t channel_length)
+{
+    return journal.dir != NULL && channel_length >= durable_prefix_length
+            && ! memcmp (channel_name, durable_prefix, durable_prefix_length);
+}
+
+
+char *journal_path (unsigned long long number)
+{
+    char *path;
+    asprintf (&path, "%s/%020llu.journal", journal.dir, number);
+    return path;
+}
+
+
+int journal_segment_compare (const void *a, const void *b)
+{
+    const struct journal_segment *x = a;
+    const struct journal_segment *y = b;
+    return (x->number > y->number) - (x->number < y->number);
+}
+
+
+//find the segments, restore the history they hold and start a new one
+void journal_open ()
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct journal_segment *segments = NULL;
+    u_int count = 0;
+    u_int size = 0;
+    struct timespec start, end;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    if ((dir = opendir (journal.dir)) == NULL) {
+        fanout_error ("ERROR cannot open journal directory");
+    }
+    while ((entry = readdir (dir)) != NULL) {
+        char *suffix;
+        unsigned long long number = strtoull (entry->d_name, &suffix, 10);
+        if (suffix == entry->d_name || strcmp (suffix, ".journal"))
+            continue;
+
+        if (count == size) {
+            size = size ? size * 2 : 64;
+            if ((segments = realloc (segments, size * sizeof (*segments)))
+                 == NULL) {
+                fanout_error ("ERROR unable to allocate memory");
+            }
+        }
+        memset (&segments[count], 0, sizeof (*segments));
+        segments[count++].number = number;
+    }
+    closedir (dir);
+    qsort (segments, count, sizeof (*segments), journal_segment_compare);
+
+    for (u_int i = 0; i < count; i++) {
+        journal_load_summary (&segments[i]);
+    }
+    journal_restore (segments, count);
+
+    journal.number = count ? segments[count - 1].number : 0;
+    journal.segments = segments;
+    journal.segment_count = count;
+    journal.segment_size = size;
+    //after the restore has evicted the channels over history_channels
+    journal_collect ();
+    journal_segment_create (0);
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    fanout_debug (1, "restored %llu messages from %d journal segments in "
+                   "%ld ms\n", journal.recovered_count, count,
+                   (end.tv_sec - start.tv_sec) * 1000
+                   + (end.tv_nsec - start.tv_nsec) / 1000000);
+}
+
+
+//read the channel summary of a segment, one left open by a crash is
+//scanned once and sealed
+void journal_load_summary (struct journal_segment *segment)
+{
+    struct journal_header header;
+    char *path = journal_path (segment->number);
+    int fd;
+
+    if ((fd = open (path, O_RDWR | O_CLOEXEC)) == -1
+         || pread (fd, &header, sizeof (header), 0) != sizeof (header)
+         || memcmp (header.magic, JOURNAL_MAGIC, sizeof (header.magic))) {
+        //created but never committed to
+        fanout_debug (1, "skipping journal segment %s\n", path);
+        if (fd != -1)
+            close (fd);
+        free (path);
+        return;
+    }
+
+    if ( ! header.sealed) {
+        fanout_debug (1, "sealing journal segment %s\n", path);
+        char *map = NULL;
+        if (header.committed > 0
+             && (map = mmap (NULL, JOURNAL_HEADER_SIZE + header.committed,
+                             PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            fanout_error ("ERROR mapping journal segment");
+        }
+
+        journal.number = segment->number;
+        for (size_t offset = 0; offset < header.committed; ) {
+            struct journal_record *record = (struct journal_record *)
+                (map + JOURNAL_HEADER_SIZE + offset);
+            journal_count (get_channel (record->data, record->channel_length),
+                           record->seq);
+            offset += JOURNAL_ALIGN (sizeof (*record) + record->length);
+        }
+        if (map != NULL)
+            munmap (map, JOURNAL_HEADER_SIZE + header.committed);
+        free (journal_write_summary (fd, &header));
+    }
+
+    segment->summary_length = header.summary_length;
+    if ((segment->summary = malloc (header.summary_length + 1)) == NULL) {
+        fanout_error ("ERROR unable to allocate memory");
+    }
+    if (pread (fd, segment->summary, header.summary_length,
+               header.summary_offset) != (ssize_t) header.summary_length) {
+        fanout_error ("ERROR reading journal summary");
+    }
+    close (fd);
+    free (path);
+}
+
+
+//work out from the summaries, newest first, which segments hold the last
+//history_messages of each channel and replay only those
+void journal_restore (struct journal_segment *segments, u_int count)
+{
+    for (u_int i = count; i-- > 0; ) {
+        struct journal_segment *segment = &segments[i];
+
+        for (size_t offset = 0; offset < segment->summary_length; ) {
+            struct journal_summary *summary = (struct journal_summary *)
+                (segment->summary + offset);
+            struct channel *channel = get_channel ((char *) (summary + 1),
+                                                   summary->channel_length);
+
+            //journal_entry counts down the messages still to be found
+            if (channel->journal_number != ULLONG_MAX) {
+                channel->journal_number = ULLONG_MAX;
+                channel->journal_entry = history_messages;
+            }
+            if (summary->last_seq > channel->history.seq)
+                channel->history.seq = summary->last_seq;
+            //newer segments move it back, nothing is evicted until the
+            //records are read
+            channel_idle (channel);
+            if (channel->journal_entry > 0) {
+                segment->needed = 1;
+                channel->journal_entry -= summary->count
+                    < channel->journal_entry ? summary->count
+                                             : channel->journal_entry;
+            }
+            offset += JOURNAL_ALIGN (sizeof (*summary)
+                                     + summary->channel_length);
+        }
+    }
+
+    for (u_int i = 0; i < count; i++) {
+        struct journal_header header;
+        char *path;
+        char *map;
+        int fd;
+
+        if ( ! segments[i].needed)
+            continue;
+
+        path = journal_path (segments[i].number);
+        if ((fd = open (path, O_RDONLY | O_CLOEXEC)) == -1
+             || pread (fd, &header, sizeof (header), 0) != sizeof (header)) {
+            fanout_error ("ERROR reading journal segment");
+        }
+        if ((map = mmap (NULL, JOURNAL_HEADER_SIZE + header.committed,
+                         PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            fanout_error ("ERROR mapping journal segment");
+        }
+        madvise (map, JOURNAL_HEADER_SIZE + header.committed,
+                 MADV_SEQUENTIAL);
+
+        for (size_t offset = 0; offset < header.committed; ) {
+            struct journal_record *record = (struct journal_record *)
+                (map + JOURNAL_HEADER_SIZE + offset);
+            struct message *m = message_create (record->length);
+
+            memcpy (m->data, record->data, record->length);
+            m->channel_length = record->channel_length;
+            m->seq = record->seq;
+            m->binary_only = ! message_is_text (m->data, m->channel_length,
+                                                m->data + m->channel_length
+                                                + 1, m->length
+                                                - m->channel_length - 2);
+            history_push (find_channel (record->data, record->channel_length),
+                          m);
+            message_release (m);
+
+            journal.recovered_count++;
+            offset += JOURNAL_ALIGN (sizeof (*record) + record->length);
+        }
+        munmap (map, JOURNAL_HEADER_SIZE + header.committed);
+        close (fd);
+        free (path);
+    }
+    evict_idle_channels ();
+}
+
+
+//start the next segment with room for at least length bytes of records
+void journal_segment_create (size_t length)
+{
+    struct journal_header *header;
+    char *path;
+
+    if (length < journal_segment_size)
+        length = journal_segment_size;
+
+    journal.number++;
+    path = journal_path (journal.number);
+    if ((journal.fd = open (path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                            0644)) == -1
+         || ftruncate (journal.fd, JOURNAL_HEADER_SIZE + length) == -1) {
+        fanout_error ("ERROR creating journal segment");
+    }
+    if ((journal.map = mmap (NULL, JOURNAL_HEADER_SIZE + length,
+                             PROT_READ | PROT_WRITE, MAP_SHARED, journal.fd,
+                             0)) == MAP_FAILED) {
+        fanout_error ("ERROR mapping journal segment");
+    }
+
+    header = (struct journal_header *) journal.map;
+    memcpy (header->magic, JOURNAL_MAGIC, sizeof (header->magic));
+    header->number = journal.number;
+    if (msync (journal.map, JOURNAL_HEADER_SIZE, MS_SYNC) == -1) {
+        fanout_error ("ERROR syncing journal segment");
+    }
+    journal_sync_dir ();
+
+    journal.map_length = length;
+    journal.tail = 0;
+    journal.synced = 0;
+    journal.record_count = 0;
+    fanout_debug (2, "created journal segment %s\n", path);
+    free (path);
+}
+
+
+//copy a numbered message into the open segment, it reaches the disk with
+//the rest of the batch in journal_commit
+void journal_append (struct channel *c, struct message *m)
+{
+    size_t length = JOURNAL_ALIGN (sizeof (struct journal_record)
+                                   + m->length);
+
+    if (journal.tail + length > journal.map_length) {
+        journal_seal ();
+        journal_segment_create (length);
+        journal_collect ();
+    }
+
+    struct journal_record *record = (struct journal_record *)
+        (journal.map + JOURNAL_HEADER_SIZE + journal.tail);
+    record->seq = m->seq;
+    record->length = m->length;
+    record->channel_length = m->channel_length;
+    memcpy (record->data, m->data, m->length);
+
+    journal.tail += length;
+    journal.record_count++;
+    journal_count (c, m->seq);
+}
+
+
+void journal_count (struct channel *c, unsigned long long seq)
+{
+    struct journal_channel *entry;
+
+    if (c->journal_number != journal.number) {
+        if (journal.channel_count == journal.channel_size) {
+            journal.channel_size = journal.channel_size
+                                   ? journal.channel_size * 2 : 64;
+            if ((journal.channels = realloc (journal.channels,
+                                             journal.channel_size
+                                             * sizeof (*entry))) == NULL) {
+                fanout_error ("ERROR unable to allocate memory");
+            }
+        }
+        entry = &journal.channels[journal.channel_count];
+        if ((entry->name = malloc (c->name_length)) == NULL) {
+            fanout_error ("ERROR unable to allocate memory");
+        }
+        memcpy (entry->name, c->name, c->name_length);
+        entry->name_length = c->name_length;
+        entry->count = 0;
+        c->journal_entry = journal.channel_count++;
+        c->journal_number = journal.number;
+    }
+
+    entry = &journal.channels[c->journal_entry];
+    entry->last_seq = seq;
+    entry->count++;
+}
+
+
+//group commit, everything appended since the last call is synced at once
+//and only then counted as committed in the header
+void journal_commit ()
+{
+    struct journal_header *header = (struct journal_header *) journal.map;
+    size_t start = JOURNAL_HEADER_SIZE
+                   + (journal.synced & ~((size_t) JOURNAL_HEADER_SIZE - 1));
+
+    if (journal.synced == journal.tail)
+        return;
+
+    if (msync (journal.map + start, JOURNAL_HEADER_SIZE + journal.tail - start,
+               MS_SYNC) == -1) {
+        fanout_error ("ERROR syncing journal segment");
+    }
+    header->committed = journal.tail;
+    header->record_count = journal.record_count;
+    if (msync (journal.map, JOURNAL_HEADER_SIZE, MS_SYNC) == -1) {
+        fanout_error ("ERROR syncing journal segment");
+    }
+    journal.synced = journal.tail;
+
+    if (journal.commit_count == ULLONG_MAX) {
+        fanout_debug (1, "wow, you've committed alot..resetting counter\n");
+        journal.commit_count = 0;
+    }
+    journal.commit_count++;
+}
+
+
+//called before anything is sent, a message leaves only once the record
+//numbering it is on disk, even when room is needed before the batch ends
+void journal_commit_pending ()
+{
+    if (journal.synced != journal.tail)
+        journal_commit ();
+}
+
+
+void journal_seal ()
+{
+    struct journal_header header;
+    char *summary;
+
+    journal_commit ();
+    header = *(struct journal_header *) journal.map;
+    munmap (journal.map, JOURNAL_HEADER_SIZE + journal.map_length);
+    journal.map = NULL;
+    summary = journal_write_summary (journal.fd, &header);
+    close (journal.fd);
+    journal.fd = -1;
+    journal_keep (journal.number, summary, header.summary_length);
+}
+
+
+//append the channel totals after the records and trim the segment, the
+//header is marked sealed once the summary is on disk; returns the summary
+//for the caller to free
+char *journal_write_summary (int fd, struct journal_header *header)
+{
+    size_t length = 0;
+    size_t offset = 0;
+    char *summary;
+
+    for (u_int i = 0; i < journal.channel_count; i++) {
+        length += JOURNAL_ALIGN (sizeof (struct journal_summary)
+                                 + journal.channels[i].name_length);
+    }
+    if ((summary = calloc (1, length + 1)) == NULL) {
+        fanout_error ("ERROR unable to allocate memory");
+    }
+    for (u_int i = 0; i < journal.channel_count; i++) {
+        struct journal_channel *entry = &journal.channels[i];
+        struct journal_summary *s = (struct journal_summary *)
+            (summary + offset);
+
+        s->last_seq = entry->last_seq;
+        s->count = entry->count;
+        s->channel_length = entry->name_length;
+        memcpy (s + 1, entry->name, entry->name_length);
+        offset += JOURNAL_ALIGN (sizeof (*s) + entry->name_length);
+        free (entry->name);
+    }
+    journal.channel_count = 0;
+
+    header->summary_offset = JOURNAL_HEADER_SIZE + header->committed;
+    header->summary_length = length;
+    header->sealed = 1;
+    if (pwrite (fd, summary, length, header->summary_offset)
+         != (ssize_t) length
+         || ftruncate (fd, header->summary_offset + length) == -1
+         || fdatasync (fd) == -1
+         || pwrite (fd, header, sizeof (*header), 0) != sizeof (*header)
+         || fdatasync (fd) == -1) {
+        fanout_error ("ERROR writing journal summary");
+    }
+    return summary;
+}
+
+
+void journal_keep (unsigned long long number, char *summary,
+                   size_t summary_length)
+{
+    struct journal_segment *segment;
+
+    if (journal.segment_count == journal.segment_size) {
+        journal.segment_size = journal.segment_size
+                               ? journal.segment_size * 2 : 64;
+        if ((journal.segments = realloc (journal.segments,
+                                         journal.segment_size
+                                         * sizeof (*segment))) == NULL) {
+            fanout_error ("ERROR unable to allocate memory");
+        }
+    }
+    segment = &journal.segments[journal.segment_count++];
+    memset (segment, 0, sizeof (*segment));
+    segment->number = number;
+    segment->summary = summary;
+    segment->summary_length = summary_length;
+}
+
+
+//remove the sealed segments holding none of the last history_messages of
+//any channel, newer segments supersede them down to the sequence numbers;
+//worked out from the summaries newest first as journal_restore does, so
+//the journal and the startup time follow the history kept
+void journal_collect ()
+{
+    u_int kept = 0;
+
+    //marked again below as each channel's countdown starts, segment
+    //numbers start at 1
+    for (u_int i = 0; i < journal.segment_count; i++) {
+        struct journal_segment *segment = &journal.segments[i];
+
+        for (size_t offset = 0; offset < segment->summary_length; ) {
+            struct journal_summary *summary = (struct journal_summary *)
+                (segment->summary + offset);
+            struct channel *channel = find_channel ((char *) (summary + 1),
+                                                    summary->channel_length);
+            if (channel != NULL)
+                channel->journal_number = 0;
+            offset += JOURNAL_ALIGN (sizeof (*summary)
+                                     + summary->channel_length);
+        }
+    }
+
+    for (u_int i = journal.segment_count; i-- > 0; ) {
+        struct journal_segment *segment = &journal.segments[i];
+
+        segment->needed = 0;
+        for (size_t offset = 0; offset < segment->summary_length; ) {
+            struct journal_summary *summary = (struct journal_summary *)
+                (segment->summary + offset);
+            struct channel *channel = find_channel ((char *) (summary + 1),
+                                                    summary->channel_length);
+
+            offset += JOURNAL_ALIGN (sizeof (*summary)
+                                     + summary->channel_length);
+            //evicted, its history went with it
+            if (channel == NULL)
+                continue;
+
+            //journal_entry counts down the messages still to be found,
+            //journal_count starts a new entry for it in the open segment
+            if (channel->journal_number != ULLONG_MAX) {
+                channel->journal_number = ULLONG_MAX;
+                channel->journal_entry = history_messages;
+            }
+            if (channel->journal_entry > 0) {
+                segment->needed = 1;
+                channel->journal_entry -= summary->count
+                    < channel->journal_entry ? summary->count
+                                             : channel->journal_entry;
+            }
+        }
+    }
+
+    for (u_int i = 0; i < journal.segment_count; i++) {
+        struct journal_segment *segment = &journal.segments[i];
+        char *path;
+
+        if (segment->needed) {
+            journal.segments[kept++] = *segment;
+            continue;
+        }
+
+        path = journal_path (segment->number);
+        fanout_debug (2, "removing journal segment %s\n", path);
+        if (unlink (path) == -1 && errno != ENOENT)
+            fanout_debug (1, "ERROR removing journal segment %s: %s\n",
+                           path, strerror (errno));
+        free (path);
+        free (segment->summary);
+
+        if (journal.removed_count == ULLONG_MAX) {
+            fanout_debug (1, "wow, you've removed alot..resetting counter\n");
+            journal.removed_count = 0;
+        }
+        journal.removed_count++;
+    }
+    journal.segment_count = kept;
+}
+
+
+//make a new segment's directory entry durable
+void journal_sync_dir ()
+{
+    int fd;
+
+    if ((fd = open (journal.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1
+         || fsync (fd) == -1) {
+        fanout_error ("ERROR syncing journal directory");
+    }
+    close (fd);
+}
+
+
+u_int pattern_hash (struct pattern_node *parent, const char *segment,
+                    size_t segment_length)
+{
+    return channel_hash (segment, segment_length)
+           ^ (u_int) ((uintptr_t) parent >> 4) * 2654435761u;
+}
+
+
+void pattern_table_resize (u_int size)
+{
+    struct pattern_node **new_table;
+
+    if ((new_table = calloc (size, sizeof (struct pattern_node *))) == NULL) {
+        fanout_error ("memory error");
+    }
+
+    for (u_int i = 0; i < pattern_table_size; i++) {
+        struct pattern_node *node_i = pattern_table[i];
+        while (node_i != NULL) {
+            struct pattern_node *node_tmp = node_i;
+            node_i = node_i->next;
+
+            u_int bucket = node_tmp->hash & (size - 1);
+            node_tmp->previous = NULL;
+            node_tmp->next = new_table[bucket];
+            if (new_table[bucket] != NULL)
+                new_table[bucket]->previous = node_tmp;
+            new_table[bucket] = node_tmp;
+        }
+    }
+
+    free (pattern_table);
+    pattern_table = new_table;
+    pattern_table_size = size;
+}
+
+
+struct pattern_node *find_pattern_child (struct pattern_node *parent,
+                                         const char *segment,
+                                         size_t segment_length)
+{
+    if (pattern_table == NULL)
+        return NULL;
+
+    u_int hash = pattern_hash (parent, segment, segment_length);
+    struct pattern_node *node_i = pattern_table[hash
+                                                & (pattern_table_size - 1)];
+
+    while (node_i != NULL) {
+        if (node_i->hash == hash && node_i->parent == parent
+             && node_i->segment_length == segment_length
+             && ! memcmp (node_i->segment, segment, segment_length))
+            return node_i;
+        node_i = node_i->next;
+    }
+    return NULL;
+}
+
+
+//walk the trie along the '.' separated segments of a pattern, creating the
+//missing nodes when asked to; a run of '#' segments matches the same as one
+//so they all lead to the node of the first
+struct pattern_node *find_pattern (const char *pattern,
+                                   size_t pattern_length, int create)
+{
+    struct pattern_node *node = &pattern_root;
+    size_t position = 0;
+
+    while (position <= pattern_length) {
+        const char *segment = pattern + position;
+        const char *dot = memchr (segment, '.', pattern_length - position);
+        size_t segment_length = dot ? dot - segment
+                                    : pattern_length - position;
+        struct pattern_node **wildcard = NULL;
+        struct pattern_node *child;
+
+        if (segment_length == 1 && *segment == '*') {
+            wildcard = &node->wildcard_one;
+        } else if (segment_length == 1 && *segment == '#') {
+            if (node != &pattern_root && node == node->parent->wildcard_many) {
+                position += 2;
+                continue;
+            }
+            wildcard = &node->wildcard_many;
+        }
+
+        child = wildcard ? *wildcard
+                         : find_pattern_child (node, segment, segment_length);
+
+        if (child == NULL) {
+            if ( ! create)
+                return NULL;
+
+            if ((child = calloc (1, sizeof (struct pattern_node))) == NULL
+                 || (child->segment = malloc (segment_length)) == NULL) {
+                fanout_error ("memory error");
+            }
+            memcpy (child->segment, segment, segment_length);
+            child->segment_length = segment_length;
+            child->parent = node;
+            node->child_count++;
+
+            if (wildcard != NULL) {
+                *wildcard = child;
+            } else {
+                //keep the load factor at or below 1
+                if (pattern_node_count >= pattern_table_size)
+                    pattern_table_resize (pattern_table_size
+                                          ? pattern_table_size * 2 : 64);
+
+                child->hash = pattern_hash (node, segment, segment_length);
+                u_int bucket = child->hash & (pattern_table_size - 1);
+                child->next = pattern_table[bucket];
+                if (pattern_table[bucket] != NULL)
+                    pattern_table[bucket]->previous = child;
+                pattern_table[bucket] = child;
+                pattern_node_count++;
+            }
+        }
+
+        node = child;
+        position += segment_length + 1;
+    }
+    return node;
+}
+
+
+struct channel *get_pattern_channel (const char *pattern,
+                                     size_t pattern_length)
+{
+    struct pattern_node *node = find_pattern (pattern, pattern_length, 1);
+    struct channel *channel_i;
+
+    if (node->channel != NULL)
+        return node->channel;
+
+    fanout_debug (2, "creating new pattern %.*s\n", (int) pattern_length,
+                   pattern);
+    if ((channel_i = pool_alloc (&pools[POOL_CHANNEL])) == NULL) {
+        fanout_error ("memory error");
+    }
+    channel_set_name (channel_i, pattern, pattern_length);
+    channel_i->pattern = node;
+    node->channel = channel_i;
+
+    if (stats.current_pattern_count++ == 0 && shard_count > 1)
+        __atomic_or_fetch (&pattern_shards,
+                           (uint64_t) 1 << current_shard->id,
+                           __ATOMIC_RELAXED);
+    return channel_i;
+}
+
+
+void remove_pattern (struct channel *c)
+{
+    struct pattern_node *node = c->pattern;
+
+    fanout_debug (2, "removing unused pattern %s\n", c->name);
+    node->channel = NULL;
+
+    //prune the branch that no longer leads to any pattern
+    while (node != &pattern_root && node->channel == NULL
+            && node->child_count == 0) {
+        struct pattern_node *parent = node->parent;
+
+        if (node == parent->wildcard_one) {
+            parent->wildcard_one = NULL;
+        } else if (node == parent->wildcard_many) {
+            parent->wildcard_many = NULL;
+        } else {
+            if (node->next != NULL)
+                node->next->previous = node->previous;
+            if (node->previous != NULL)
+                node->previous->next = node->next;
+            u_int bucket = node->hash & (pattern_table_size - 1);
+            if (node == pattern_table[bucket])
+                pattern_table[bucket] = node->next;
+            pattern_node_count--;
+        }
+        parent->child_count--;
+        free (node->segment);
+        free (node);
+        node = parent;
+    }
+
+    if (--stats.current_pattern_count == 0 && shard_count > 1)
+        __atomic_and_fetch (&pattern_shards,
+                            ~((uint64_t) 1 << current_shard->id),
+                            __ATOMIC_RELAXED);
+}
+
+
+u_int pattern_segments (const char *name, size_t name_length)
+{
+    u_int segments = 1;
+    const char *dot = name;
+
+    while ((dot = memchr (dot, '.', name_length - (dot - name))) != NULL) {
+        segments++;
+        dot++;
+    }
+    return segments;
+}
+
+
+//whether the node is yet to be tried at the segment during this walk
+int pattern_visit (struct pattern_node *node, u_int segment)
+{
+    uint64_t bit = (uint64_t) 1 << segment % 64;
+
+    if (node->walk != pattern_walk) {
+        node->walk = pattern_walk;
+        memset (node->visited, 0, sizeof (node->visited));
+    }
+    if (node->visited[segment / 64] & bit)
+        return 0;
+    node->visited[segment / 64] |= bit;
+    return 1;
+}
+
+
+//deliver to every pattern matching the channel, channels of more than
+//PATTERN_MAX_SEGMENTS segments match none
+void pattern_match (const char *channel_name, size_t channel_length,
+                    struct message *m, struct message **frame)
+{
+    if (pattern_segments (channel_name, channel_length)
+         > PATTERN_MAX_SEGMENTS)
+        return;
+    pattern_walk++;
+    pattern_match_node (&pattern_root, channel_name, channel_length, 0, 0, m,
+                        frame);
+}
+
+
+//deliver to every pattern below node that matches the channel from the
+//segment at position on, the work follows the matching branches only and
+//visits each node at each segment once
+void pattern_match_node (struct pattern_node *node, const char *channel_name,
+                         size_t channel_length, size_t position,
+                         u_int segment, struct message *m,
+                         struct message **frame)
+{
+    if ( ! pattern_visit (node, segment))
+        return;
+
+    //'#' starts out taking no segments
+    if (node->wildcard_many != NULL)
+        pattern_match_node (node->wildcard_many, channel_name, channel_length,
+                            position, segment, m, frame);
+
+    //every segment is used up
+    if (position > channel_length) {
+        if (node->channel != NULL)
+            deliver_message (node->channel, m, frame);
+        return;
+    }
+
+    const char *dot = memchr (channel_name + position, '.',
+                              channel_length - position);
+    size_t end = dot ? dot - channel_name : channel_length;
+
+    struct pattern_node *child = NULL;
+    if (node->child_count > (node->wildcard_one != NULL)
+                            + (node->wildcard_many != NULL))
+        child = find_pattern_child (node, channel_name + position,
+                                    end - position);
+    if (child != NULL)
+        pattern_match_node (child, channel_name, channel_length, end + 1,
+                            segment + 1, m, frame);
+    if (node->wildcard_one != NULL)
+        pattern_match_node (node->wildcard_one, channel_name, channel_length,
+                            end + 1, segment + 1, m, frame);
+    //and takes one more segment at a time
+    if (node != &pattern_root && node == node->parent->wildcard_many)
+        pattern_match_node (node, channel_name, channel_length, end + 1,
+                            segment + 1, m, frame);
+}
+
+
+//whether pattern_match would deliver to anyone, walked the same way
+int pattern_matches (const char *channel_name, size_t channel_length)
+{
+    if (pattern_segments (channel_name, channel_length)
+         > PATTERN_MAX_SEGMENTS)
+        return 0;
+    pattern_walk++;
+    return pattern_matches_node (&pattern_root, channel_name, channel_length,
+                                 0, 0);
+}
+
+
+//a node tried before at the segment did not match then either
+int pattern_matches_node (struct pattern_node *node, const char *channel_name,
+                          size_t channel_length, size_t position,
+                          u_int segment)
+{
+    const char *dot;
+
+    if ( ! pattern_visit (node, segment))
+        return 0;
+
+    if (node->wildcard_many != NULL
+         && pattern_matches_node (node->wildcard_many, channel_name,
+                                  channel_length, position, segment))
+        return 1;
+
+    if (position > channel_length)
+        return node->channel != NULL;
+
+    dot = memchr (channel_name + position, '.', channel_length - position);
+    size_t end = dot ? dot - channel_name : channel_length;
+
+    struct pattern_node *child = NULL;
+    if (node->child_count > (node->wildcard_one != NULL)
+                            + (node->wildcard_many != NULL))
+        child = find_pattern_child (node, channel_name + position,
+                                    end - position);
+    if (child != NULL && pattern_matches_node (child, channel_name,
+                                               channel_length, end + 1,
+                                               segment + 1))
+        return 1;
+    if (node->wildcard_one != NULL
+         && pattern_matches_node (node->wildcard_one, channel_name,
+                                  channel_length, end + 1, segment + 1))
+        return 1;
+    return node != &pattern_root && node == node->parent->wildcard_many
+           && pattern_matches_node (node, channel_name, channel_length,
+                                    end + 1, segment + 1);
+}
+
+
+void remove_client (struct client *c)
+{
+    char *peer = getsocketpeername (c->fd);
+    fanout_debug (3, "removing client %d connected from %s from service\n",
+                   c->fd, peer);
     if (c->next != NULL) {
+        if (c->previous != NULL)
+            fanout_debug (3, "setting previous on %d to %d\n",
+                           c->next->fd, c->previous->fd);
         c->next->previous = c->previous;
     }
-    if (c->previous != NULL) {
-        c->previous->next = c->next;
+    if (c->previous != NULL) {
+        if (c->next != NULL)
+            fanout_debug (3, "setting next on %d to %d\n",
+                           c->previous->fd, c->next->fd);
+        c->previous->next = c->next;
+    }
+    if (c == client_head) {
+        client_head = c->next;
+    }
+    __atomic_sub_fetch (&current_client_count, 1, __ATOMIC_RELAXED);
+}
+
+
+void shutdown_client (struct client *c)
+{
+    while (c->subscription_head != NULL)
+        end_subscription (c->subscription_head);
+
+    remove_client (c);
+    if (shutdown (c->fd, 2) == -1) {
+        fanout_debug (1, "ERROR calling shutdown on client %d\n", c->fd);
+    }
+    clear_socket_buffer (c->fd);
+    if (close (c->fd) == -1) {
+        fanout_debug (1, "ERROR closing the socket on client %d\n", c->fd);
+    }
+    destroy_client (c);
+}
+
+
+void destroy_client (struct client *c)
+{
+    free (c->input.data);
+    struct output_queue *q = &c->output_queue;
+    while (q->count > 0) {
+        message_release (q->messages[q->start]);
+        q->start = (q->start + 1) & (q->size - 1);
+        q->count--;
+    }
+    free (q->messages);
+    //freed once the ring completes the receive or send still referring to it
+    if (c->receiving || c->send != NULL) {
+        c->released = 1;
+        return;
+    }
+    pool_free (&pools[POOL_CLIENT], c);
+}
+
+
+void client_write (struct client *c, const char *data)
+{
+    struct message *m = message_from_string (data);
+
+    client_write_message (c, m);
+    message_release (m);
+}
+
+
+void client_write_message (struct client *c, struct message *m)
+{
+    ssize_t sent = 0;
+
+    if (c->closing)
+        return;
+
+    if (batching) {
+        //make room by writing out what the batch has queued so far
+        if (max_output_buffer > 0
+             && c->output_queue.length + m->length > max_output_buffer)
+            client_flush (c);
+
+        if (max_output_buffer == 0
+             || c->output_queue.length + m->length <= max_output_buffer) {
+            client_queue_message (c, m, 0);
+            client_flush_later (c);
+            return;
+        }
+    }
+
+    //anything already queued has to go out first
+    if (c->output_queue.count == 0) {
+        journal_commit_pending ();
+        errno = 0;
+        if ((sent = send (c->fd, m->data, m->length, MSG_NOSIGNAL)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                //the read side will notice the broken connection
+                fanout_debug (3, "failed writing to client %d: %s\n", c->fd,
+                               strerror (errno));
+                return;
+            }
+            sent = 0;
+        }
+        fanout_debug (3, "wrote %d bytes\n", (int) sent);
+
+        if (sent == m->length)
+            return;
+
+    }
+
+    //a partially sent message is always queued to keep the stream intact
+    if (max_output_buffer > 0 && sent == 0
+         && c->output_queue.length + m->length - sent > max_output_buffer
+         && ! client_make_room (c, m, m->length - sent))
+        return;
+
+    client_watch_output (c, 1);
+    client_queue_message (c, m, sent);
+    fanout_debug (3, "remaining output queue is %d bytes in %d message(s)\n",
+                   (u_int) c->output_queue.length, c->output_queue.count);
+}
+
+
+void client_queue_message (struct client *c, struct message *m,
+                           size_t offset)
+{
+    struct output_queue *q = &c->output_queue;
+
+    if (q->count == q->size) {
+        u_int size = q->size ? q->size * 2 : 16;
+        struct message **messages;
+
+        if ((messages = malloc (size * sizeof (struct message *))) == NULL) {
+            fanout_error ("ERROR unable to allocate memory");
+        }
+        //unwrap the ring into the new array
+        for (u_int i = 0; i < q->count; i++) {
+            messages[i] = q->messages[(q->start + i) & (q->size - 1)];
+        }
+        free (q->messages);
+        q->messages = messages;
+        q->size = size;
+        q->start = 0;
+    }
+
+    if (q->count == 0)
+        q->offset = offset;
+
+    message_retain (m);
+    q->messages[(q->start + q->count) & (q->size - 1)] = m;
+    q->count++;
+    q->length += m->length - offset;
+}
+
+
+void client_flush (struct client *c)
+{
+    struct output_queue *q = &c->output_queue;
+    struct iovec iov[64];
+    struct msghdr msg;
+
+    if (q->count > 0)
+        histogram_observe (&stats.output_queue_histogram,
+                           HISTOGRAM_COUNT_FIRST, q->count);
+    fanout_probe2 (client_flush, c->fd, q->count);
+    journal_commit_pending ();
+
+    //the ring sends what a pass queued, but room needed in the middle of a
+    //pass is made right away as with epoll, unless a send is in flight
+    if (io_backend == IO_BACKEND_URING && ( ! batching || c->send != NULL)) {
+        uring_send (c);
+        return;
+    }
+
+    while (q->count > 0) {
+        int iovcnt = 0;
+
+        //gather as many queued messages as fit in a single sendmsg
+        for (u_int i = 0; i < q->count
+              && iovcnt < sizeof (iov) / sizeof (iov[0]); i++) {
+            struct message *m = q->messages[(q->start + i) & (q->size - 1)];
+            size_t skip = (i == 0) ? q->offset : 0;
+
+            iov[iovcnt].iov_base = m->data + skip;
+            iov[iovcnt].iov_len = m->length - skip;
+            iovcnt++;
+        }
+
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        errno = 0;
+        ssize_t sent = sendmsg (c->fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                fanout_debug (3, "remaining output queue is %d bytes in %d \
+message(s)\n", (u_int) q->length, q->count);
+                return;
+            }
+            //the read side will notice the broken connection
+            fanout_debug (3, "failed writing to client %d: %s\n", c->fd,
+                           strerror (errno));
+            sent = q->length;
+        }
+        fanout_debug (3, "wrote %d bytes\n", (int) sent);
+
+        output_queue_advance (q, sent);
+    }
+
+    client_watch_output (c, 0);
+}
+
+
+//drop the messages a send took in full, and note how far into the next
+void output_queue_advance (struct output_queue *q, size_t sent)
+{
+    q->length -= sent;
+    while (q->count > 0) {
+        struct message *m = q->messages[q->start];
+        size_t remaining = m->length - q->offset;
+
+        if (sent < remaining) {
+            q->offset += sent;
+            break;
+        }
+
+        sent -= remaining;
+        q->offset = 0;
+        message_release (m);
+        q->start = (q->start + 1) & (q->size - 1);
+        q->count--;
+    }
+}
+
+
+int client_make_room (struct client *c, struct message *m, size_t length)
+{
+    struct output_queue *q = &c->output_queue;
+    //a partially sent message has to be completed to keep the stream intact
+    u_int first = (q->count > 0 && q->offset > 0) ? 1 : 0;
+
+    //as do the messages of a send in flight
+    if (c->send != NULL && c->send->count > first)
+        first = c->send->count;
+
+    switch (slow_consumer_policy) {
+        case POLICY_DISCONNECT:
+            fanout_debug (1, "client %d exceeded max output buffer, \
+disconnecting\n", c->fd);
+            client_close_later (c);
+            if (stats.slow_consumer_disconnects_count == ULLONG_MAX) {
+                fanout_debug (1, "wow, you've disconnected alot of slow \
+consumers..resetting counter\n");
+                stats.slow_consumer_disconnects_count = 0;
+            }
+            stats.slow_consumer_disconnects_count++;
+            return 0;
+
+        case POLICY_COALESCE:
+            //only the newest message of a channel is worth delivering
+            if (m->channel_length > 0) {
+                u_int kept = first;
+                for (u_int i = first; i < q->count; i++) {
+                    u_int from = (q->start + i) & (q->size - 1);
+                    struct message *queued = q->messages[from];
+
+                    if (queued->channel_length == m->channel_length
+                         && ! memcmp (queued->data + queued->channel_offset,
+                                      m->data + m->channel_offset,
+                                      m->channel_length)) {
+                        q->length -= queued->length;
+                        message_release (queued);
+                        if (stats.coalesced_count == ULLONG_MAX) {
+                            fanout_debug (1, "wow, you've coalesced alot..\
+resetting counter\n");
+                            stats.coalesced_count = 0;
+                        }
+                        stats.coalesced_count++;
+                        continue;
+                    }
+                    q->messages[(q->start + kept) & (q->size - 1)] = queued;
+                    kept++;
+                }
+                q->count = kept;
+            }
+            //fall through to drop-oldest if that was not enough
+        case POLICY_DROP_OLDEST:
+            while (q->count > first
+                    && q->length + length > max_output_buffer) {
+                u_int oldest = (q->start + first) & (q->size - 1);
+                struct message *queued = q->messages[oldest];
+
+                q->length -= queued->length;
+                message_release (queued);
+                //close the gap left behind the messages kept
+                for (u_int j = first; j > 0; j--) {
+                    q->messages[(q->start + j) & (q->size - 1)] =
+                        q->messages[(q->start + j - 1) & (q->size - 1)];
+                }
+                q->start = (q->start + 1) & (q->size - 1);
+                q->count--;
+                if (stats.dropped_oldest_count == ULLONG_MAX) {
+                    fanout_debug (1, "wow, you've dropped alot..\
+resetting counter\n");
+                    stats.dropped_oldest_count = 0;
+                }
+                stats.dropped_oldest_count++;
+            }
+            if (q->length + length <= max_output_buffer)
+                return 1;
+            //the message can never fit
+        case POLICY_DROP_NEWEST:
+            fanout_debug (3, "dropping message for slow client %d\n", c->fd);
+            if (stats.dropped_newest_count == ULLONG_MAX) {
+                fanout_debug (1, "wow, you've dropped alot..\
+resetting counter\n");
+                stats.dropped_newest_count = 0;
+            }
+            stats.dropped_newest_count++;
+            return 0;
+    }
+    return 0;
+}
+
+
+void client_close_later (struct client *c)
+{
+    if (c->closing)
+        return;
+
+    c->closing = 1;
+    c->close_next = close_head;
+    close_head = c;
+}
+
+
+void close_pending_clients ()
+{
+    struct epoll_event ev;
+
+    while (close_head != NULL) {
+        struct client *client_i = close_head;
+        close_head = client_i->close_next;
+
+        if (io_backend == IO_BACKEND_URING) {
+            uring_cancel (client_i);
+        } else if (epoll_ctl (epollfd, EPOLL_CTL_DEL, client_i->fd,
+                              &ev) == -1) {
+            fanout_error ("epoll_ctl: srvsock");
+        }
+        shutdown_client (client_i);
+    }
+}
+
+
+void client_flush_later (struct client *c)
+{
+    if (c->flush_pending)
+        return;
+
+    c->flush_pending = 1;
+    c->flush_next = flush_head;
+    flush_head = c;
+}
+
+
+void flush_pending_clients ()
+{
+    while (flush_head != NULL) {
+        struct client *client_i = flush_head;
+        flush_head = client_i->flush_next;
+        client_i->flush_pending = 0;
+
+        if (client_i->closing)
+            continue;
+
+        //whatever the socket doesn't take is left to EPOLLOUT
+        client_flush (client_i);
+        if (client_i->output_queue.count > 0)
+            client_watch_output (client_i, 1);
+    }
+}
+
+
+void client_watch_output (struct client *c, int enable)
+{
+    struct epoll_event ev;
+
+    //the ring waits for the socket itself
+    if (io_backend == IO_BACKEND_URING || c->watching_output == enable)
+        return;
+
+    c->watching_output = enable;
+    ev.events = enable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl (epollfd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+        fanout_error ("epoll_ctl: client");
+    }
+}
+
+
+ssize_t client_read (struct client *c, int *eof)
+{
+    struct input_buffer *in = &c->input;
+    size_t total = 0;
+    ssize_t res;
+
+    //reclaim the space of lines handled by the last read
+    if (in->start > 0) {
+        memmove (in->data, in->data + in->start, in->length + 1);
+        in->start = 0;
+    }
+
+    //drain the socket, but leave the other clients a turn once the budget
+    //is spent, level triggered epoll reports the rest
+    while (total < read_budget) {
+        input_reserve (in, 4096);
+
+        size_t want = in->size - in->length - 1;
+        if (want > read_budget - total)
+            want = read_budget - total;
+
+        errno = 0;
+        if ((res = recv (c->fd, in->data + in->length, want, 0)) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fanout_debug (2, "failed reading from client %d: %s\n",
+                               c->fd, strerror (errno));
+                *eof = 1;
+            }
+            break;
+        }
+        if (res == 0) {
+            *eof = 1;
+            break;
+        }
+
+        in->length += res;
+        in->data[in->length] = '\0';
+        total += res;
+
+        //a short read means the socket is empty
+        if (res < want)
+            break;
+    }
+
+    return total;
+}
+
+
+//room for length more bytes plus the terminating NUL
+void input_reserve (struct input_buffer *in, size_t length)
+{
+    while (in->size - in->length < length + 1) {
+        size_t size = in->size ? in->size * 2 : 8192;
+        char *data;
+
+        if ((data = realloc (in->data, size)) == NULL) {
+            fanout_error ("ERROR unable to allocate memory");
+        }
+        in->data = data;
+        in->size = size;
+    }
+}
+
+
+//bytes received by other means than client_read
+void input_append (struct input_buffer *in, const char *data, size_t length)
+{
+    if (in->start > 0) {
+        memmove (in->data, in->data + in->start, in->length + 1);
+        in->start = 0;
+    }
+    input_reserve (in, length);
+    memcpy (in->data + in->length, data, length);
+    in->length += length;
+    in->data[in->length] = '\0';
+}
+
+
+void client_process_input_buffer (struct client *c)
+{
+    if (c->binary) {
+        client_process_frames (c);
+        return;
+    }
+
+    char *message;
+    char *action;
+    char *channel;
+    char *cursor;
+
+    struct input_buffer *in = &c->input;
+    char *line;
+    char *end;
+    size_t line_length;
+
+    fanout_debug (3, "full buffer\n\n%s\n\n", in->data + in->start);
+    //lines are handled in place, the newline is overwritten to terminate
+    //them and the buffer is compacted by the next read
+    while ((end = memchr (in->data + in->start, '\n', in->length)) != NULL) {
+        line = in->data + in->start;
+        line_length = end - line;
+        *end = '\0';
+
+        in->start += line_length + 1;
+        in->length -= line_length + 1;
+        fanout_debug (3, "line is %d chars: %s\n", (int) line_length, line);
+
+        //lines following mannounce <count> are <channel> <message> pairs
+        if (c->announce_lines > 0) {
+            c->announce_lines--;
+            cursor = line;
+            channel = line_token (&cursor, end);
+            if (channel != NULL && cursor < end)
+                announce (channel, strlen (channel), cursor, end - cursor);
+            continue;
+        }
+
+        if (line_length == 4 && ! memcmp (line, "ping", 4)) {
+            client_ping (c);
+        } else if (line_length == 4 && ! memcmp (line, "info", 4)) {
+            client_info (c);
+        } else if (line_length == 5 && ! memcmp (line, "trace", 5)) {
+            client_trace (c);
+        } else if (line_length == 6 && ! memcmp (line, "binary", 6)) {
+            //everything after the handshake is framed
+            fanout_debug (2, "client %d switched to binary frames\n", c->fd);
+            c->binary = 1;
+            client_process_frames (c);
+            return;
+        } else {
+            cursor = line;
+            action = line_token (&cursor, end);
+            channel = line_token (&cursor, end);
+            if (action == NULL || channel == NULL) {
+                fanout_debug (3, "received garbage from client\n");
+            } else {
+                if ( ! strcmp (action, "announce")) {
+                    //perform announce, the message is the rest of the line
+                    message = cursor;
+                    if (message < end)
+                        announce (channel, strlen (channel), message,
+                                  end - message);
+                } else if ( ! strcmp (action, "subscribe")) {
+                    //text messages carry no sequence number to resume
+                    //from, replay is only offered in binary mode and a
+                    //since-seq gets a live subscription and a notice
+                    char *since = line_token (&cursor, end);
+                    if (strchr (channel, '!') != NULL) {
+                        fanout_debug (3, "invalid channel name\n");
+                    } else {
+                        subscribe (c, channel, strlen (channel));
+                        if (since != NULL && is_numeric (since))
+                            client_write (c, "debug!since-seq requires \
+binary mode, subscribed without replay\n");
+                    }
+                } else if ( ! strcmp (action, "unsubscribe")) {
+                    //perform unsubscribe
+                    if (strchr (channel, '!') == NULL)
+                        unsubscribe (c, channel, strlen (channel));
+                } else if ( ! strcmp (action, "psubscribe")) {
+                    //perform subscribe to a pattern
+                    if (strchr (channel, '!') == NULL)
+                        psubscribe (c, channel, strlen (channel));
+                } else if ( ! strcmp (action, "punsubscribe")) {
+                    //perform unsubscribe from a pattern
+                    if (strchr (channel, '!') == NULL)
+                        punsubscribe (c, channel, strlen (channel));
+                } else if ( ! strcmp (action, "msubscribe")) {
+                    //perform subscribe for every listed channel
+                    do {
+                        if (strchr (channel, '!') == NULL)
+                            subscribe (c, channel, strlen (channel));
+                    } while ((channel = line_token (&cursor, end)) != NULL);
+                } else if ( ! strcmp (action, "munsubscribe")) {
+                    //perform unsubscribe for every listed channel
+                    do {
+                        if (strchr (channel, '!') == NULL)
+                            unsubscribe (c, channel, strlen (channel));
+                    } while ((channel = line_token (&cursor, end)) != NULL);
+                } else if ( ! strcmp (action, "mannounce")) {
+                    //the announcements follow on their own lines
+                    if (is_numeric (channel))
+                        c->announce_lines = strtoul (channel, NULL, 10);
+                    else
+                        fanout_debug (3, "invalid mannounce count\n");
+                } else {
+                    fanout_debug (3, "invalid action attempted\n");
+                }
+            }
+        }
+    }
+
+    fanout_debug (3, "remaining input buffer is %d chars: %s\n",
+             (int) in->length, in->data + in->start);
+}
+
+
+void client_ping (struct client *c)
+{
+    char *message;
+
+    asprintf (&message, "%d\n", (u_int) time(NULL));
+    client_reply (c, FRAME_PING, message);
+    free (message);
+    if (stats.pings_count == ULLONG_MAX) {
+        fanout_debug (1, "wow, you've pinged alot..\
+resetting counter\n");
+        stats.pings_count = 0;
+    }
+    stats.pings_count++;
+}
+
+
+void client_info (struct client *c)
+{
+    char *message;
+
+    struct stats total;
+    stats_total (&total);
+    u_int clients = __atomic_load_n (&current_client_count,
+                                     __ATOMIC_RELAXED);
+
+    u_int current_requested_subscriptions =
+        (total.current_subscription_count - clients);
+    //uptime
+    long uptime = (long)time (NULL) - server_start_time;
+
+    //averages
+
+    asprintf (&message,
+"uptime: %ldd %ldh %ldm %lds\n\
+client-limit: %d\n\
+limit rejected connections: %llu\n\
+rlimits: Soft=%d Hard=%d\n\
+max connections: %d\n\
+current connections: %d\n\
+current channels: %d\n\
+current subscriptions: %d\n\
+user-requested subscriptions: %d\n\
+total connections: %llu\n\
+total announcements: %llu\n\
+total messages: %llu\n\
+total subscribes: %llu\n\
+total unsubscribes: %llu\n\
+total pings: %llu\n\
+max output buffer: %lu\n\
+slow consumer policy: %s\n\
+slow consumer disconnects: %llu\n\
+dropped oldest messages: %llu\n\
+dropped newest messages: %llu\n\
+coalesced messages: %llu\n\
+current patterns: %d\n\
+history messages: %d\n\
+history bytes: %lu\n\
+current history messages: %d\n\
+current history bytes: %lu\n\
+history channels: %u\n\
+idle history channels: %u\n\
+evicted history channels: %llu\n\
+journal segment: %llu\n\
+journal commits: %llu\n\
+journal recovered messages: %llu\n\
+journal segments: %u\n\
+journal removed segments: %llu\n\
+client pool: %u/%u\n\
+subscription pool: %u/%u\n\
+channel pool: %u/%u\n\
+threads: %d\n\
+listen backlog: %d\n\
+listen mode: %s\n\
+io backend: %s\n\
+accepts per second: %u\n\
+max accepts per second: %u\n\
+max events: %d\n\
+total event waits: %llu\n\
+total events: %llu\n\
+dropped log records: %llu\
+\n",                   uptime/3600/24, uptime/3600%24,
+               uptime/60%60, uptime%60,
+               client_limit,
+               total.client_limit_count,
+               (int) s_rlimit.rlim_cur,
+               (int)s_rlimit.rlim_max,
+               max_client_count,
+               clients, total.current_channel_count,
+               total.current_subscription_count,
+               current_requested_subscriptions, total.clients_count,
+               total.announcements_count, total.messages_count,
+               total.subscriptions_count,
+               total.unsubscriptions_count, total.pings_count,
+               (unsigned long) max_output_buffer,
+               slow_consumer_policy_names[slow_consumer_policy],
+               total.slow_consumer_disconnects_count,
+               total.dropped_oldest_count,
+               total.dropped_newest_count, total.coalesced_count,
+               total.current_pattern_count, history_messages,
+               (unsigned long) history_bytes, total.current_history_count,
+               (unsigned long) total.current_history_length,
+               history_channels, total.current_idle_channel_count,
+               total.evicted_channels_count,
+               journal.number, journal.commit_count, journal.recovered_count,
+               journal.segment_count, journal.removed_count,
+               total.pool_used[POOL_CLIENT], total.pool_capacity[POOL_CLIENT],
+               total.pool_used[POOL_SUBSCRIPTION],
+               total.pool_capacity[POOL_SUBSCRIPTION],
+               total.pool_used[POOL_CHANNEL], total.pool_capacity[POOL_CHANNEL],
+               shard_count, listen_backlog, listen_mode_names[listen_mode],
+               io_backend_names[io_backend],
+               total.accepts_last_second, total.max_accepts_per_second,
+               max_events, total.event_waits_count,
+               total.events_count,
+               __atomic_load_n (&log_dropped_count, __ATOMIC_RELAXED));
+    client_reply (c, FRAME_INFO, message);
+    free (message);
+}
+
+
+void client_trace (struct client *c)
+{
+    char *report = trace_report ();
+
+    client_reply (c, FRAME_TRACE, report);
+    free (report);
+}
+
+
+//the metrics port only answers GET /metrics, each connection is closed
+//once its response is written
+void metrics_listen (struct addrinfo *ai)
+{
+    struct epoll_event ev;
+    struct linger so_linger;
+    struct addrinfo *runp;
+
+    for (runp = ai; runp != NULL; runp = runp->ai_next) {
+        metrics_listener_count++;
+    }
+    if ((metrics_listeners = calloc (metrics_listener_count,
+                                     sizeof (struct listener))) == NULL) {
+        fanout_error ("memory error");
+    }
+
+    int n = 0;
+    for (runp = ai; runp != NULL; runp = runp->ai_next, n++) {
+        metrics_listeners[n].type = FD_TYPE_METRICS_LISTENER;
+        metrics_listeners[n].fd = listen_socket (runp, listen_backlog);
+
+        //responses are closed right after being written, they have to be
+        //delivered rather than discarded
+        so_linger.l_onoff = 0;
+        so_linger.l_linger = 0;
+        if (setsockopt (metrics_listeners[n].fd, SOL_SOCKET, SO_LINGER,
+                        &so_linger, sizeof so_linger) == -1) {
+            fanout_error ("failed setting linger");
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = &metrics_listeners[n];
+        if (epoll_ctl (shards[0].epollfd, EPOLL_CTL_ADD,
+                       metrics_listeners[n].fd, &ev) == -1) {
+            fanout_error ("epoll_ctl: metrics");
+        }
+    }
+
+    if ((metrics_timer.fd = timerfd_create (CLOCK_MONOTONIC,
+                                            TFD_NONBLOCK | TFD_CLOEXEC))
+         == -1) {
+        fanout_error ("ERROR creating metrics timer");
     }
-    if (c == channel_head) {
-        channel_head = c->next;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &metrics_timer;
+    if (epoll_ctl (shards[0].epollfd, EPOLL_CTL_ADD, metrics_timer.fd,
+                   &ev) == -1) {
+        fanout_error ("epoll_ctl: metrics timer");
     }
 }
 
 
-void destroy_channel (struct channel *c)
+void metrics_accept (struct listener *listener)
 {
-    free (c->name);
-    free (c);
-}
+    struct epoll_event ev;
+    struct metrics_client *mc;
 
+    while (1) {
+        int fd;
 
-u_int channel_count ()
-{
-    struct channel *channel_i = channel_head;
-    u_int count = 0;
+        if ((fd = accept4 (listener->fd, NULL, NULL,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            //the listener stays readable with the connection pending, it
+            //is refused like those of the clients' listeners
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS
+                 || errno == ENOMEM) {
+                if (accept_failed (listener, errno))
+                    continue;
+                return;
+            }
+            fanout_debug (1, "metrics accept: %s\n", strerror (errno));
+            return;
+        }
 
-    while (channel_i != NULL) {
-        count++;
-        channel_i = channel_i->next;
+        if (metrics_client_count >= METRICS_MAX_CLIENTS) {
+            fanout_debug (2, "metrics clients at their limit of %d\n",
+                           METRICS_MAX_CLIENTS);
+            close (fd);
+            continue;
+        }
+
+        if ((mc = calloc (1, sizeof (struct metrics_client))) == NULL) {
+            fanout_debug (0, "memory error\n");
+            close (fd);
+            continue;
+        }
+        mc->type = FD_TYPE_METRICS;
+        mc->fd = fd;
+        mc->connected = time (NULL);
+        mc->next = metrics_clients;
+        if (metrics_clients != NULL)
+            metrics_clients->previous = mc;
+        metrics_clients = mc;
+        if (metrics_client_count++ == 0)
+            metrics_timer_arm (1);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = mc;
+        if (epoll_ctl (epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            fanout_error ("epoll_ctl: metrics client");
+        }
+        fanout_debug (3, "metrics client %d connected\n", fd);
     }
-    return count;
 }
 
 
-struct client *get_client (int fd)
+void metrics_read (struct metrics_client *mc)
 {
-    struct client *client_i = NULL;
+    ssize_t res;
+
+    //already answering
+    if (mc->response != NULL)
+        return;
+
+    while (1) {
+        res = read (mc->fd, mc->request + mc->request_length,
+                    METRICS_REQUEST_SIZE - 1 - mc->request_length);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            break;
+        }
+        if (res == 0)
+            break;
 
-    client_i = client_head;
-    while (client_i != NULL) {
-        if (client_i->fd == fd)
-            return client_i;
-        client_i = client_i->next;
+        mc->request_length += res;
+        mc->request[mc->request_length] = '\0';
+
+        //the headers are not needed, only their end
+        if (strstr (mc->request, "\r\n\r\n") != NULL
+             || strstr (mc->request, "\n\n") != NULL) {
+            metrics_respond (mc);
+            return;
+        }
+        if (mc->request_length == METRICS_REQUEST_SIZE - 1) {
+            fanout_debug (1, "metrics request too large\n");
+            break;
+        }
     }
-    return NULL;
+    metrics_close (mc);
 }
 
 
-void remove_client (struct client *c)
+void metrics_respond (struct metrics_client *mc)
 {
-    char *peer = getsocketpeername (c->fd);
-    fanout_debug (3, "removing client %d connected from %s from service\n",
-                   c->fd, peer);
-    if (c->next != NULL) {
-        if (c->previous != NULL)
-            fanout_debug (3, "setting previous on %d to %d\n",
-                           c->next->fd, c->previous->fd);
-        c->next->previous = c->previous;
+    struct epoll_event ev;
+    const char *status = "404 Not Found";
+    char *body = NULL;
+    size_t body_length = 0;
+    FILE *out;
+
+    //the query string is ignored
+    if ( ! strncmp (mc->request, "GET /metrics", 12)
+         && strchr (" ?", mc->request[12]) != NULL
+         && mc->request[12] != '\0') {
+        status = "200 OK";
+        if ((out = open_memstream (&body, &body_length)) == NULL) {
+            fanout_error ("memory error");
+        }
+        metrics_render (out);
+        fclose (out);
     }
-    if (c->previous != NULL) {
-        if (c->next != NULL)
-            fanout_debug (3, "setting next on %d to %d\n",
-                           c->previous->fd, c->next->fd);
-        c->previous->next = c->next;
+
+    if (asprintf (&mc->response, "HTTP/1.1 %s\r\n\
+Content-Type: text/plain; version=0.0.4\r\n\
+Content-Length: %lu\r\n\
+Connection: close\r\n\
+\r\n\
+%s", status, (unsigned long) body_length,
+                   body != NULL ? body : "") == -1) {
+        fanout_error ("memory error");
     }
-    if (c == client_head) {
-        client_head = c->next;
+    mc->response_length = strlen (mc->response);
+    free (body);
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = mc;
+    if (epoll_ctl (epollfd, EPOLL_CTL_MOD, mc->fd, &ev) == -1) {
+        fanout_error ("epoll_ctl: metrics client");
     }
+    metrics_write (mc);
 }
 
 
-void shutdown_client (struct client *c)
+void metrics_write (struct metrics_client *mc)
 {
-    struct subscription *subscription_i = subscription_head;
-
-    while (subscription_i != NULL) {
-        struct subscription *subscription_tmp = subscription_i;
-        subscription_i = subscription_i->next;
+    ssize_t sent;
 
-        if (c == subscription_tmp->client)
-            unsubscribe (c, subscription_tmp->channel->name);
+    while (mc->sent < mc->response_length) {
+        sent = send (mc->fd, mc->response + mc->sent,
+                     mc->response_length - mc->sent, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            fanout_debug (3, "failed writing to metrics client %d: %s\n",
+                           mc->fd, strerror (errno));
+            break;
+        }
+        mc->sent += sent;
     }
+    metrics_close (mc);
+}
 
-    remove_client (c);
-    if (shutdown (c->fd, 2) == -1) {
-        fanout_debug (1, "ERROR calling shutdown on client %d\n", c->fd);
-    }
-    clear_socket_buffer (c->fd);
-    if (close (c->fd) == -1) {
-        fanout_debug (1, "ERROR closing the socket on client %d\n", c->fd);
+
+void metrics_close (struct metrics_client *mc)
+{
+    fanout_debug (3, "metrics client %d disconnected\n", mc->fd);
+    if (mc->next != NULL)
+        mc->next->previous = mc->previous;
+    if (mc->previous != NULL)
+        mc->previous->next = mc->next;
+    else
+        metrics_clients = mc->next;
+    if (--metrics_client_count == 0)
+        metrics_timer_arm (0);
+
+    //closing removes it from the epoll set
+    close (mc->fd);
+    free (mc->response);
+    free (mc);
+}
+
+
+void metrics_timer_arm (int armed)
+{
+    struct itimerspec spec;
+
+    memset (&spec, 0, sizeof (spec));
+    if (armed) {
+        spec.it_value.tv_sec = 1;
+        spec.it_interval.tv_sec = 1;
     }
-    destroy_client (c);
+    if (timerfd_settime (metrics_timer.fd, 0, &spec, NULL) == -1)
+        fanout_error ("ERROR setting metrics timer");
 }
 
 
-void destroy_client (struct client *c)
+//connections that never send a complete request would hold their
+//descriptor for good
+void metrics_expire ()
 {
-    free (c->input_buffer);
-    free (c->output_buffer);
-    free (c);
+    uint64_t expirations;
+    time_t now = time (NULL);
+    struct metrics_client *mc = metrics_clients;
+
+    while (read (metrics_timer.fd, &expirations, sizeof (expirations)) > 0)
+        ;
+
+    while (mc != NULL) {
+        struct metrics_client *next = mc->next;
+        if (mc->response == NULL && now - mc->connected >= METRICS_TIMEOUT) {
+            fanout_debug (2, "metrics client %d timed out\n", mc->fd);
+            metrics_close (mc);
+        }
+        mc = next;
+    }
 }
 
 
-void client_write (struct client *c, const char *data)
+//Prometheus text exposition of everything info reports
+void metrics_render (FILE *out)
 {
-    c->output_buffer = str_append (c->output_buffer, data);
+    struct stats total;
+    stats_total (&total);
+    u_int clients = __atomic_load_n (&current_client_count,
+                                     __ATOMIC_RELAXED);
+
+    metrics_gauge (out, "fanout_uptime_seconds", "seconds since start",
+                   (long) time (NULL) - server_start_time);
+    metrics_gauge (out, "fanout_client_limit", "max connections allowed",
+                   client_limit);
+    metrics_counter (out, "fanout_limit_rejected_connections_total",
+                     "connections refused at the client limit",
+                     total.client_limit_count);
+    metrics_gauge (out, "fanout_max_connections",
+                   "most connections at once", max_client_count);
+    metrics_gauge (out, "fanout_current_connections",
+                   "connected clients", clients);
+    metrics_gauge (out, "fanout_current_channels", "channels",
+                   total.current_channel_count);
+    metrics_gauge (out, "fanout_current_subscriptions",
+                   "subscriptions, including every client's to all",
+                   total.current_subscription_count);
+    metrics_gauge (out, "fanout_user_requested_subscriptions",
+                   "subscriptions requested by clients",
+                   total.current_subscription_count - clients);
+    metrics_counter (out, "fanout_connections_total", "accepted connections",
+                     total.clients_count);
+    metrics_counter (out, "fanout_announcements_total", "announcements",
+                     total.announcements_count);
+    metrics_counter (out, "fanout_messages_total",
+                     "messages delivered to subscribers",
+                     total.messages_count);
+    metrics_counter (out, "fanout_subscribes_total", "subscribes",
+                     total.subscriptions_count);
+    metrics_counter (out, "fanout_unsubscribes_total", "unsubscribes",
+                     total.unsubscriptions_count);
+    metrics_counter (out, "fanout_pings_total", "pings", total.pings_count);
+    metrics_gauge (out, "fanout_max_output_buffer",
+                   "queued output allowed per client in bytes, 0 = unlimited",
+                   max_output_buffer);
+    metrics_counter (out, "fanout_slow_consumer_disconnects_total",
+                     "clients disconnected for exceeding the output buffer",
+                     total.slow_consumer_disconnects_count);
+    metrics_counter (out, "fanout_dropped_oldest_messages_total",
+                     "queued messages dropped for newer ones",
+                     total.dropped_oldest_count);
+    metrics_counter (out, "fanout_dropped_newest_messages_total",
+                     "messages dropped for full output buffers",
+                     total.dropped_newest_count);
+    metrics_counter (out, "fanout_coalesced_messages_total",
+                     "queued messages replaced by newer ones on the same \
+channel", total.coalesced_count);
+    metrics_gauge (out, "fanout_current_patterns", "pattern subscriptions",
+                   total.current_pattern_count);
+    metrics_gauge (out, "fanout_current_history_messages",
+                   "messages kept for replay", total.current_history_count);
+    metrics_gauge (out, "fanout_current_history_bytes",
+                   "bytes kept for replay", total.current_history_length);
+    metrics_gauge (out, "fanout_current_idle_history_channels",
+                   "channels kept for their history without subscribers",
+                   total.current_idle_channel_count);
+    metrics_counter (out, "fanout_evicted_history_channels_total",
+                     "idle channels dropped with their history",
+                     total.evicted_channels_count);
+    metrics_gauge (out, "fanout_journal_segment", "open journal segment",
+                   journal.number);
+    metrics_counter (out, "fanout_journal_commits_total",
+                     "journal syncs to disk", journal.commit_count);
+    metrics_counter (out, "fanout_journal_recovered_messages_total",
+                     "messages restored from the journal at startup",
+                     journal.recovered_count);
+    metrics_gauge (out, "fanout_journal_segments",
+                   "sealed journal segments still holding history",
+                   journal.segment_count);
+    metrics_counter (out, "fanout_journal_removed_segments_total",
+                     "journal segments removed once superseded",
+                     journal.removed_count);
+
+    fprintf (out, "# HELP fanout_pool_used objects allocated from a pool\n\
+# TYPE fanout_pool_used gauge\n\
+fanout_pool_used{pool=\"client\"} %u\n\
+fanout_pool_used{pool=\"subscription\"} %u\n\
+fanout_pool_used{pool=\"channel\"} %u\n\
+# HELP fanout_pool_capacity objects that fit the slabs of a pool\n\
+# TYPE fanout_pool_capacity gauge\n\
+fanout_pool_capacity{pool=\"client\"} %u\n\
+fanout_pool_capacity{pool=\"subscription\"} %u\n\
+fanout_pool_capacity{pool=\"channel\"} %u\n",
+             total.pool_used[POOL_CLIENT],
+             total.pool_used[POOL_SUBSCRIPTION],
+             total.pool_used[POOL_CHANNEL],
+             total.pool_capacity[POOL_CLIENT],
+             total.pool_capacity[POOL_SUBSCRIPTION],
+             total.pool_capacity[POOL_CHANNEL]);
+
+    metrics_gauge (out, "fanout_threads", "event loop threads", shard_count);
+    metrics_gauge (out, "fanout_accepts_per_second",
+                   "connections accepted in the last second",
+                   total.accepts_last_second);
+    metrics_gauge (out, "fanout_max_accepts_per_second",
+                   "most connections accepted in a second",
+                   total.max_accepts_per_second);
+    metrics_counter (out, "fanout_event_waits_total",
+                     "epoll_wait calls returning events",
+                     total.event_waits_count);
+    metrics_counter (out, "fanout_events_total", "events handled",
+                     total.events_count);
+    metrics_counter (out, "fanout_dropped_log_records_total",
+                     "log records dropped with the writer behind",
+                     __atomic_load_n (&log_dropped_count, __ATOMIC_RELAXED));
+
+    metrics_histogram (out, "fanout_announce_fanout",
+                       "subscribers reached per announcement",
+                       &total.fanout_histogram, HISTOGRAM_COUNT_FIRST, 1);
+    metrics_histogram (out, "fanout_announce_duration_seconds",
+                       "time spent handling an announcement",
+                       &total.announce_histogram, HISTOGRAM_TIME_FIRST,
+                       1e-9);
+    metrics_histogram (out, "fanout_output_queue_depth",
+                       "messages queued for a client when it is written to",
+                       &total.output_queue_histogram, HISTOGRAM_COUNT_FIRST,
+                       1);
+    metrics_histogram (out, "fanout_event_loop_duration_seconds",
+                       "time handling the events of one epoll_wait",
+                       &total.loop_histogram, HISTOGRAM_TIME_FIRST, 1e-9);
+}
 
-    while (strlen (c->output_buffer) > 0) {
-        int sent = send (c->fd, c->output_buffer, strlen (c->output_buffer),
-                      MSG_NOSIGNAL);
-        if (sent == -1)
-            break;
-        fanout_debug (3, "wrote %d bytes\n", sent);
-        str_swap_free (&c->output_buffer, substr (c->output_buffer, sent,
-                        strlen (c->output_buffer)));
-    }
-    fanout_debug (3, "remaining output buffer is %d chars: %s\n",
-             (u_int) strlen (c->output_buffer), c->output_buffer);
+
+void metrics_counter (FILE *out, const char *name, const char *help,
+                      unsigned long long value)
+{
+    fprintf (out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help,
+             name, name, value);
 }
 
 
-void client_process_input_buffer (struct client *c)
+void metrics_gauge (FILE *out, const char *name, const char *help,
+                    double value)
 {
-    char *message;
-    char *action;
-    char *channel;
+    fprintf (out, "# HELP %s %s\n# TYPE %s gauge\n%s %.15g\n", name, help,
+             name, name, value);
+}
 
-    int i;
-
-    fanout_debug (3, "full buffer\n\n%s\n\n", c->input_buffer);
-    while ((i = strcpos (c->input_buffer, '\n')) >= 0) {
-        char *line = substr (c->input_buffer, 0, i -1);
-        fanout_debug (3, "buffer has a newline at char %d\n", i);
-        fanout_debug (3, "line is %d chars: %s\n", (u_int) strlen (line), line);
-
-        if ( ! strcmp (line, "ping")) {
-            asprintf (&message, "%d\n", (u_int) time(NULL));
-            client_write (c, message);
-            free (message);
-            message = NULL;
-            if (pings_count == ULLONG_MAX) {
-                fanout_debug (1, "wow, you've pinged alot..\
-resetting counter\n");
-                pings_count = 0;
-            }
-            pings_count++;
-        } else if ( ! strcmp (line, "info")) {
 
-            //current connections
-            u_int current_client_count = client_count ();
+//buckets are exported cumulatively with their bounds converted by scale
+void metrics_histogram (FILE *out, const char *name, const char *help,
+                        struct histogram *h, unsigned long long first,
+                        double scale)
+{
+    unsigned long long count = 0;
 
-            //channels
-            u_int current_channel_count = channel_count ();
+    fprintf (out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += h->buckets[i];
+        fprintf (out, "%s_bucket{le=\"%g\"} %llu\n", name,
+                 (double) (first << i) * scale, count);
+    }
+    //other shards keep counting while this runs, the total is taken from
+    //the buckets so that it matches them
+    count += h->buckets[HISTOGRAM_BUCKETS];
+    fprintf (out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.15g\n%s_count %llu\n",
+             name, count, name, (double) h->sum * scale, name, count);
+}
 
-            //subscriptions
-            u_int current_subscription_count = subscription_count ();
-            u_int current_requested_subscriptions = (current_subscription_count
-                                                      - current_client_count);
-            //uptime
-            long uptime = (long)time (NULL) - server_start_time;
 
-            //averages
+void client_process_frames (struct client *c)
+{
+    struct input_buffer *in = &c->input;
+    u_char *header;
+    char *channel;
+    char *payload;
+    size_t channel_length;
+    size_t payload_length;
+
+    //frames are self delimiting, nothing is scanned or copied
+    while (in->length >= FRAME_HEADER_LENGTH) {
+        header = (u_char *) in->data + in->start;
+        channel_length = (header[2] << 8) | header[3];
+        payload_length = ((size_t) header[4] << 24) | (header[5] << 16)
+                         | (header[6] << 8) | header[7];
+
+        if (in->length < FRAME_HEADER_LENGTH + channel_length
+                          + payload_length)
+            break;
 
-            asprintf (&message,
-"uptime: %ldd %ldh %ldm %lds\n\
-client-limit: %d\n\
-limit rejected connections: %llu\n\
-rlimits: Soft=%d Hard=%d\n\
-max connections: %d\n\
-current connections: %d\n\
-current channels: %d\n\
-current subscriptions: %d\n\
-user-requested subscriptions: %d\n\
-total connections: %llu\n\
-total announcements: %llu\n\
-total messages: %llu\n\
-total subscribes: %llu\n\
-total unsubscribes: %llu\n\
-total pings: %llu\
-\n",                   uptime/3600/24, uptime/3600%24,
-                       uptime/60%60, uptime%60,
-                       client_limit,
-                       client_limit_count,
-                       (int) s_rlimit.rlim_cur,
-                       (int)s_rlimit.rlim_max,
-                       max_client_count,
-                       current_client_count, current_channel_count,
-                       current_subscription_count,
-                       current_requested_subscriptions, clients_count,
-                       announcements_count, messages_count, subscriptions_count,
-                       unsubscriptions_count, pings_count);
-            client_write (c, message);
-            free (message);
-            message = NULL;
-        } else {
-            action = strtok (line, " ");
-            channel = strtok (NULL, " ");
-            if (action == NULL || channel == NULL) {
-                fanout_debug (3, "received garbage from client\n");
-            } else {
-                if ( ! strcmp (action, "announce")) {
-                    //perform announce
-                    message = substr (line,
-                                       strlen (action) + strlen (channel) + 2,
-                                       strlen (line));
-                    if (channel_exists (channel) && strlen (message) > 0)
-                        announce (channel, message);
-                    free (message);
-                } else if ( ! strcmp (action, "subscribe")) {
-                    //perform subscribe
-                    if (strcpos (channel, '!') == -1)
-                        subscribe (c, channel);
-                } else if ( ! strcmp (action, "unsubscribe")) {
-                    //perform unsubscribe
-                    if (strcpos (channel, '!') == -1)
-                        unsubscribe (c, channel);
-                } else {
-                    fanout_debug (3, "invalid action attempted\n");
+        channel = (char *) header + FRAME_HEADER_LENGTH;
+        payload = channel + channel_length;
+        in->start += FRAME_HEADER_LENGTH + channel_length + payload_length;
+        in->length -= FRAME_HEADER_LENGTH + channel_length + payload_length;
+
+        switch (header[0]) {
+            case FRAME_ANNOUNCE:
+                if (channel_length > 0 && payload_length > 0)
+                    announce (channel, channel_length, payload,
+                              payload_length);
+                break;
+            case FRAME_SUBSCRIBE:
+                //an 8 byte payload is the sequence number to replay after
+                if (channel_length > 0 && payload_length == 8) {
+                    unsigned long long since = 0;
+                    for (int i = 0; i < 8; i++)
+                        since = (since << 8) | (u_char) payload[i];
+                    subscribe_since (c, channel, channel_length, since);
+                } else if (channel_length > 0) {
+                    subscribe (c, channel, channel_length);
                 }
-            }
+                break;
+            case FRAME_UNSUBSCRIBE:
+                if (channel_length > 0)
+                    unsubscribe (c, channel, channel_length);
+                break;
+            case FRAME_PSUBSCRIBE:
+                if (channel_length > 0)
+                    psubscribe (c, channel, channel_length);
+                break;
+            case FRAME_PUNSUBSCRIBE:
+                if (channel_length > 0)
+                    punsubscribe (c, channel, channel_length);
+                break;
+            case FRAME_PING:
+                client_ping (c);
+                break;
+            case FRAME_INFO:
+                client_info (c);
+                break;
+            case FRAME_TRACE:
+                client_trace (c);
+                break;
+            default:
+                fanout_debug (3, "invalid frame opcode %d\n", header[0]);
+                break;
         }
+    }
 
-        str_swap_free (&c->input_buffer, substr (c->input_buffer, i + 1,
-                                   strlen (c->input_buffer)));
-        free (line);
+    fanout_debug (3, "remaining input buffer is %d bytes\n",
+                   (int) in->length);
+}
+
+
+//send a reply to a ping or info request in the client's protocol
+void client_reply (struct client *c, enum frame_opcode opcode,
+                   const char *data)
+{
+    if ( ! c->binary) {
+        client_write (c, data);
+        return;
     }
 
-    fanout_debug (3, "remaining input buffer is %d chars: %s\n",
-             (int) strlen (c->input_buffer), c->input_buffer);
+    size_t length = strlen (data);
+    if (length > 0 && data[length - 1] == '\n')
+        length--;
+
+    struct message *m = frame_create (opcode, 0, NULL, 0, data, length);
+    client_write_message (c, m);
+    message_release (m);
 }
 
 
-u_int client_count ()
+//split the next space delimited token off [*cursor, end) in place, end must
+//point at the terminating NUL of the line
+char *line_token (char **cursor, char *end)
 {
-    struct client *client_i = client_head;
-    u_int count = 0;
+    char *token = *cursor;
+    char *space;
+
+    while (token < end && *token == ' ')
+        token++;
+    if (token == end)
+        return NULL;
 
-    while (client_i != NULL) {
-        count++;
-        client_i = client_i->next;
+    if ((space = memchr (token, ' ', end - token)) == NULL) {
+        *cursor = end;
+    } else {
+        *space = '\0';
+        *cursor = space + 1;
     }
-    return count;
+    return token;
 }
 
 
 struct subscription *get_subscription (struct client *c,
                                         struct channel *channel)
 {
-    struct subscription *subscription_i = subscription_head;
-    while (subscription_i != NULL) {
-        if (subscription_i->channel == channel && c == subscription_i->client)
-            return subscription_i;
-        subscription_i = subscription_i->next;
+    struct subscription *subscription_i;
+
+    //walk whichever side of the subscription is shorter
+    if (c->subscription_count <= channel->subscription_count) {
+        subscription_i = c->subscription_head;
+        while (subscription_i != NULL) {
+            if (channel == subscription_i->channel)
+                return subscription_i;
+            subscription_i = subscription_i->client_next;
+        }
+    } else {
+        subscription_i = channel->subscription_head;
+        while (subscription_i != NULL) {
+            if (c == subscription_i->client)
+                return subscription_i;
+            subscription_i = subscription_i->channel_next;
+        }
     }
     return NULL;
 }
@@ -1114,138 +6226,361 @@ struct subscription *get_subscription (struct client *c,
 
 void remove_subscription (struct subscription *s)
 {
-    if (s->next != NULL) {
-        s->next->previous = s->previous;
+    if (s->client_next != NULL) {
+        s->client_next->client_previous = s->client_previous;
     }
-    if (s->previous != NULL) {
-        s->previous->next = s->next;
+    if (s->client_previous != NULL) {
+        s->client_previous->client_next = s->client_next;
     }
-    if (s == subscription_head) {
-        subscription_head = s->next;
+    if (s == s->client->subscription_head) {
+        s->client->subscription_head = s->client_next;
     }
+    s->client->subscription_count--;
+
+    if (s->channel_next != NULL) {
+        s->channel_next->channel_previous = s->channel_previous;
+    }
+    if (s->channel_previous != NULL) {
+        s->channel_previous->channel_next = s->channel_next;
+    }
+    if (s == s->channel->subscription_head) {
+        s->channel->subscription_head = s->channel_next;
+    }
+    s->channel->subscription_count--;
+    stats.current_subscription_count--;
 }
 
 
 void destroy_subscription (struct subscription *s)
 {
-    free (s);
+    pool_free (&pools[POOL_SUBSCRIPTION], s);
 }
 
 
-u_int subscription_count ()
+void end_subscription (struct subscription *s)
 {
-    struct subscription *subscription_i = subscription_head;
-    u_int count = 0;
+    struct channel *channel = s->channel;
 
-    while (subscription_i != NULL) {
-        count++;
-        subscription_i = subscription_i->next;
+    fanout_debug (2, "unsubscribed client %d from channel %s\n",
+                   s->client->fd, channel->name);
+
+    remove_subscription (s);
+    destroy_subscription (s);
+
+    if (stats.unsubscriptions_count == ULLONG_MAX) {
+        fanout_debug (1, "wow, you've unsubscribed alot..\
+resetting counter\n");
+        stats.unsubscriptions_count = 0;
     }
-    return count;
+    stats.unsubscriptions_count++;
+
+    //the history outlives the subscribers so reconnecting clients can
+    //catch up, up to history_channels such channels
+    if (channel_has_subscription (channel)) {
+        return;
+    } else if (channel->history.count == 0) {
+        remove_channel (channel);
+        destroy_channel (channel);
+    } else {
+        channel_idle (channel);
+        evict_idle_channels ();
+    }
+}
+
+
+void announce (const char *channel_name, size_t channel_length,
+               const char *message, size_t message_length)
+{
+    struct channel *channel;
+    uint64_t shards = 0;
+    uint64_t interest = 0;
+    int matched;
+    uint64_t start = monotonic_ns ();
+    unsigned long long delivered = stats.messages_count;
+
+    trace_begin (TRACE_ANNOUNCE);
+    trace_begin (TRACE_LOOKUP);
+    channel = find_channel (channel_name, channel_length);
+    trace_end ();
+
+    //durable channels are numbered and journaled without subscribers too
+    if (channel == NULL && channel_durable (channel_name, channel_length))
+        channel = get_channel (channel_name, channel_length);
+
+    //other shards with subscribers to this channel, and those with
+    //patterns that may match it
+    if (shard_count > 1) {
+        interest = interest_get (channel_name, channel_length,
+                                 channel_hash (channel_name, channel_length));
+        interest &= ~((uint64_t) 1 << current_shard->id);
+        shards = interest | (__atomic_load_n (&pattern_shards,
+                                              __ATOMIC_RELAXED)
+                             & ~((uint64_t) 1 << current_shard->id));
+    }
+
+    //only announcements reaching a channel or pattern are built and
+    //counted, the trie is walked twice when a pattern is all that matches
+    matched = channel != NULL || interest != 0
+              || (stats.current_pattern_count > 0
+                  && pattern_matches (channel_name, channel_length));
+    if ( ! matched && shards == 0) {
+        trace_end ();
+        return;
+    }
+
+    fanout_debug (3, "attempting to announce message %.*s to channel %.*s\n",
+                   (int) message_length, message, (int) channel_length,
+                   channel_name);
+    struct message *m = message_create (channel_length + message_length + 2);
+    memcpy (m->data, channel_name, channel_length);
+    m->data[channel_length] = '!';
+    memcpy (m->data + channel_length + 1, message, message_length);
+    m->data[m->length - 1] = '\n';
+    m->channel_length = channel_length;
+    m->binary_only = ! message_is_text (channel_name, channel_length,
+                                        message, message_length);
+
+    if (channel != NULL && history_messages > 0) {
+        m->seq = ++channel->history.seq;
+        history_push (channel, m);
+        if (channel_durable (channel_name, channel_length))
+            journal_append (channel, m);
+        if ( ! channel_has_subscription (channel)) {
+            channel_idle (channel);
+            evict_idle_channels ();
+        }
+    }
+
+    deliver_local (channel_name, channel_length, m);
+    if (shards != 0)
+        route_message (m, shards);
+
+    if (matched) {
+        if (stats.announcements_count == ULLONG_MAX) {
+            fanout_debug (1, "wow, you've announced alot..\
+resetting counter\n");
+            stats.announcements_count = 0;
+        }
+        stats.announcements_count++;
+    }
+    message_release (m);
+
+    histogram_observe (&stats.fanout_histogram, HISTOGRAM_COUNT_FIRST,
+                       stats.messages_count - delivered);
+    histogram_observe (&stats.announce_histogram, HISTOGRAM_TIME_FIRST,
+                       monotonic_ns () - start);
+    trace_end ();
+    fanout_probe3 (announce, channel_name, channel_length,
+                   stats.messages_count - delivered);
+}
+
+
+//deliver to the subscribers of the channel and of every matching pattern
+//on this shard
+void deliver_local (const char *channel_name, size_t channel_length,
+                    struct message *m)
+{
+    //built on demand and shared by every binary subscriber
+    struct message *frame = NULL;
+    struct channel *channel;
+
+    trace_begin (TRACE_LOOKUP);
+    channel = find_channel (channel_name, channel_length);
+    trace_end ();
+
+    trace_begin (TRACE_FANOUT);
+    announce_epoch++;
+    if (channel != NULL)
+        deliver_message (channel, m, &frame);
+    if (stats.current_pattern_count > 0)
+        pattern_match (channel_name, channel_length, m, &frame);
+
+    if (frame != NULL)
+        message_release (frame);
+    trace_end ();
 }
 
 
-void announce (const char *channel, const char *message)
+void deliver_message (struct channel *channel, struct message *m,
+                      struct message **frame)
 {
-    fanout_debug (3, "attempting to announce message %s to channel %s\n",
-                   message, channel);
-    char *s = NULL;
-    asprintf (&s, "%s!%s\n", channel, message);
-    struct subscription *subscription_i = subscription_head;
+    struct subscription *subscription_i = channel->subscription_head;
     while (subscription_i != NULL) {
-        fanout_debug (3, "testing subscription for client %d on channel %s\n",
-                       subscription_i->client->fd,
-                       subscription_i->channel->name);
-        if ( ! strcmp (subscription_i->channel->name, channel)) {
-            fanout_debug (3, "announcing message %s to %d on channel %s\n",
-                           message, subscription_i->client->fd, channel);
-            client_write (subscription_i->client, s);
-            //message stats
-            if (messages_count == ULLONG_MAX) {
-                fanout_debug (1, "wow, you've sent a lot of messages..\
+        struct client *client_i = subscription_i->client;
+        subscription_i = subscription_i->channel_next;
+
+        //already reached through another subscription
+        if (client_i->delivered_epoch == announce_epoch)
+            continue;
+        client_i->delivered_epoch = announce_epoch;
+
+        //it would read as other lines, or another channel, to text clients
+        if (m->binary_only && ! client_i->binary)
+            continue;
+
+        fanout_debug (3, "announcing message to %d on channel %s\n",
+                       client_i->fd, channel->name);
+        if (client_i->binary) {
+            if (*frame == NULL)
+                *frame = message_frame (m);
+            client_write_message (client_i, *frame);
+        } else {
+            client_write_message (client_i, m);
+        }
+        //message stats
+        if (stats.messages_count == ULLONG_MAX) {
+            fanout_debug (1, "wow, you've sent a lot of messages..\
 resetting counter\n");
-                messages_count = 0;
-            }
-            messages_count++;
+            stats.messages_count = 0;
         }
-        subscription_i = subscription_i->next;
+        stats.messages_count++;
     }
     fanout_debug (2, "announced message to %d client(s) %s",
-                   get_channel (channel)->subscription_count, s);
-    if (announcements_count == ULLONG_MAX) {
-        fanout_debug (1, "wow, you've announced alot..resetting counter\n");
-        announcements_count = 0;
+                   channel->subscription_count, m->data);
+}
+
+
+void route_message (struct message *m, uint64_t mask)
+{
+    for (u_int i = 0; i < shard_count; i++) {
+        if ( ! (mask & ((uint64_t) 1 << i)))
+            continue;
+
+        struct inbox_item *item;
+        if ((item = malloc (sizeof (struct inbox_item))) == NULL) {
+            fanout_error ("memory error");
+        }
+        message_retain (m);
+        item->message = m;
+        inbox_push (&shards[i].inbox, item);
+
+        //only the first push after the shard drained its inbox wakes it
+        if ( ! __atomic_exchange_n (&shards[i].inbox.signalled, 1,
+                                     __ATOMIC_SEQ_CST)) {
+            uint64_t value = 1;
+            if (write (shards[i].inbox.fd, &value, sizeof (value)) == -1) {
+                fanout_debug (1, "failed waking event loop %d: %s\n", i,
+                               strerror (errno));
+            }
+        }
     }
-    announcements_count++;
-    free (s);
 }
 
+void subscribe (struct client *c, const char *channel_name,
+                size_t channel_length)
+{
+    trace_begin (TRACE_SUBSCRIBE);
+    subscribe_channel (c, get_channel (channel_name, channel_length));
+    trace_end ();
+}
 
-void subscribe (struct client *c, const char *channel_name)
+
+void psubscribe (struct client *c, const char *pattern, size_t pattern_length)
 {
-    if (get_subscription (c, get_channel (channel_name)) != NULL) {
-        fanout_debug (3, "client %d already subscribed to channel %s\n",
-                       c->fd, channel_name);
+    if (pattern_segments (pattern, pattern_length) > PATTERN_MAX_SEGMENTS) {
+        fanout_debug (3, "pattern of more than %d segments\n",
+                       PATTERN_MAX_SEGMENTS);
         return;
     }
+    trace_begin (TRACE_SUBSCRIBE);
+    subscribe_channel (c, get_pattern_channel (pattern, pattern_length));
+    trace_end ();
+}
+
+
+//returns 1 when the client was not subscribed before
+int subscribe_channel (struct client *c, struct channel *channel)
+{
+    if (get_subscription (c, channel) != NULL) {
+        fanout_debug (3, "client %d already subscribed to channel %s\n",
+                       c->fd, channel->name);
+        return 0;
+    }
 
     struct subscription *subscription_i = NULL;
 
-    if ((subscription_i = calloc (1, sizeof (struct subscription))) == NULL) {
+    if ((subscription_i = pool_alloc (&pools[POOL_SUBSCRIPTION])) == NULL) {
         fanout_debug (1, "memory error trying to create new subscription\n");
-        return;
+        if ( ! channel_has_subscription (channel)
+              && channel->history.count == 0) {
+            remove_channel (channel);
+            destroy_channel (channel);
+        }
+        return 0;
     }
 
     subscription_i->client = c;
-    subscription_i->channel = get_channel (channel_name);
-    subscription_i->channel->subscription_count++;
+    subscription_i->channel = channel;
 
     fanout_debug (2, "subscribed client %d to channel %s\n", c->fd,
                    subscription_i->channel->name);
 
-    if (subscriptions_count == ULLONG_MAX) {
+    if (stats.subscriptions_count == ULLONG_MAX) {
         fanout_debug (1, "wow, you've subscribed alot..resetting counter\n");
-        subscriptions_count = 0;
+        stats.subscriptions_count = 0;
     }
-    subscriptions_count++;
+    stats.subscriptions_count++;
+
+    subscription_i->client_next = c->subscription_head;
+    if (c->subscription_head != NULL)
+        c->subscription_head->client_previous = subscription_i;
+    c->subscription_head = subscription_i;
+    c->subscription_count++;
+
+    subscription_i->channel_next = channel->subscription_head;
+    if (channel->subscription_head != NULL)
+        channel->subscription_head->channel_previous = subscription_i;
+    channel->subscription_head = subscription_i;
+    channel->subscription_count++;
+    stats.current_subscription_count++;
+    channel_busy (channel);
+    return 1;
+}
+
+
+//subscribe and catch up on the history announced after since
+void subscribe_since (struct client *c, const char *channel_name,
+                      size_t channel_length, unsigned long long since)
+{
+    trace_begin (TRACE_SUBSCRIBE);
+    struct channel *channel = get_channel (channel_name, channel_length);
 
-    subscription_i->next = subscription_head;
-    if (subscription_head != NULL)
-        subscription_head->previous = subscription_i;
-    subscription_head = subscription_i;
+    //already subscribed clients have had everything since then live
+    if (subscribe_channel (c, channel))
+        history_replay (c, channel, since);
+    trace_end ();
 }
 
 
-void unsubscribe (struct client *c, const char *channel_name)
+void unsubscribe (struct client *c, const char *channel_name,
+                  size_t channel_length)
 {
-    struct subscription *subscription_i = subscription_head;
-    if ( ! channel_exists (channel_name))
-        return;
-    struct channel *channel = get_channel (channel_name);
+    struct channel *channel;
 
-    while (subscription_i != NULL) {
-        if (c == subscription_i->client && channel == subscription_i->channel) {
-            remove_subscription (subscription_i);
-            destroy_subscription (subscription_i);
+    trace_begin (TRACE_SUBSCRIBE);
+    if ((channel = find_channel (channel_name, channel_length)) != NULL)
+        unsubscribe_channel (c, channel);
+    trace_end ();
+}
 
-            fanout_debug (2, "unsubscribed client %d from channel %s\n", c->fd,
-                           channel_name);
 
-            channel->subscription_count--;
+void punsubscribe (struct client *c, const char *pattern,
+                   size_t pattern_length)
+{
+    struct pattern_node *node;
 
-            if (unsubscriptions_count == ULLONG_MAX) {
-                fanout_debug (1, "wow, you've unsubscribed alot..\
-resetting counter\n");
-                unsubscriptions_count = 0;
-            }
-            unsubscriptions_count++;
+    trace_begin (TRACE_SUBSCRIBE);
+    if ((node = find_pattern (pattern, pattern_length, 0)) != NULL
+         && node->channel != NULL)
+        unsubscribe_channel (c, node->channel);
+    trace_end ();
+}
 
-            if ( ! channel_has_subscription (channel)) {
-                remove_channel (channel);
-                destroy_channel (channel);
-            }
-            return;
-        }
-        subscription_i = subscription_i->next;
-    }
+
+void unsubscribe_channel (struct client *c, struct channel *channel)
+{
+    struct subscription *subscription_i;
+
+    if ((subscription_i = get_subscription (c, channel)) != NULL)
+        end_subscription (subscription_i);
 }